@@ -1,12 +1,16 @@
 /* magnification factor. must be >0.0 */
 static float MAG_FACTOR = 3.0f;
+/* lowest factor zooming out is allowed to reach. below 1.0 the loupe shows
+ * a scaled down overview of a MAG_SIZE / MAG_FACTOR_MIN wide area, which the
+ * capture buffers grow to the first time it's zoomed out past 1x */
+static const float MAG_FACTOR_MIN = 0.1f;
 /* zoom in/out factor */
 static const float MAG_STEP = 1.025f;
 /* size of the magnifier */
 static const uint MAG_SIZE = 192;
 
-/* default scaling function */
-static const MagFunc mag_func = nearest_neighbour;
+/* default scaling function, overridden via cli arg `--mag-func` */
+static MagFunc mag_func = nearest_neighbour;
 
 /*
  * COLORS: All the colors here are in ARGB32 format, e.g 0xAARRGGBB.
@@ -31,6 +35,11 @@ static const uint CIRCLE_WIDTH = 2;
 static const XcursorPixel CIRCLE_COLOR = 0xffff3838;
 static const Bool CIRCLE_TRANSPARENT_OUTSIDE = True;
 
+/* --sample options. SAMPLE_MAX is the largest box, ctrl+scroll included */
+static const uint SAMPLE_MAX = 301;
+static const uint SAMPLE_SWATCH_SIZE = 16;
+static const XcursorPixel SAMPLE_BOX_COLOR = 0xffff3838;
+
 /* example filter sequences */
 static const FilterFunc sq_cross[] = { square, xhair };
 static const FilterFunc sq_grid_cross[] = { grid, square, xhair };
@@ -39,16 +48,36 @@ static const FilterFunc circle_grid_cross[] = { grid, circle, xhair };
 /* default filter sequence, overridden via cli arg `--mag-filters` */
 static const FilterSeq filter_default = FILTER_SEQ_FROM_ARRAY(circle_grid_cross);
 
-/* max time (in ms) allowed to go on without a redraw */
+/* max time (in ms) allowed to go on without a redraw, when the refresh rate
+ * of the monitors isn't known via RandR. redraws are paced to it otherwise. */
 static const int MAX_FRAME_TIME = 16;
 
+/* without XDamage the screen has to be re-captured periodically. after
+ * PACE_IDLE_FRAMES of those in a row that didn't change anything, the interval
+ * doubles each time, up to PACE_IDLE_MAX ms. */
+static const uint PACE_IDLE_FRAMES = 8;
+static const int PACE_IDLE_MAX = 250;
+
+/* the capture is cached with a margin of up to CACHE_HALO_MAX pixels around
+ * it, sized by how fast the pointer moves, so that small movements don't
+ * need to fetch anything. it's dropped on damage, or once it's older than
+ * CACHE_MAX_AGE ms. set CACHE_MAX_AGE to 0 to disable the cache. */
+static const uint CACHE_HALO_MAX = 64;
+static const int CACHE_MAX_AGE = 250;
+
+/* --batch captures the area it needs in bands of at most this many pixels */
+static const uint BATCH_TILE_MAX = 1024 * 1024;
+
+/* --watch polling rate, in Hz, unless given as --watch=HZ */
+static const uint WATCH_HZ = 10;
+
 /* default output format, overridden via cli arg.
- * available options: OUTPUT_{NONE,HEX,RGB,HSL,ALL}
+ * available options: OUTPUT_{NONE,HEX,RGB,HSL,HSV,LINEAR,LAB,OKLAB,OKLCH,ALL}
  * the options may be OR-ed together, e.g: `OUTPUT_RGB | OUTPUT_HSL`
  */
 static const enum output OUTPUT_DEFAULT = OUTPUT_ALL;
 
-/* convenient macro for populating the filter table */
+/* convenient macro for populating the filter and scaling function tables */
 #define FILTER_TABLE_ENTRY(X) { (uchar *)(#X), sizeof (#X) - 1 }, X
 /* table of filter functions, used by filter_parse() for mapping --mag-filters */
 static const struct { const Str str; FilterFunc f; } FILTER_TABLE[] = {
@@ -57,3 +86,9 @@ static const struct { const Str str; FilterFunc f; } FILTER_TABLE[] = {
 	{ FILTER_TABLE_ENTRY(grid)   },
 	{ FILTER_TABLE_ENTRY(circle) },
 };
+/* table of scaling functions, used for mapping --mag-func */
+static const struct { const Str str; MagFunc f; } MAG_FUNC_TABLE[] = {
+	{ FILTER_TABLE_ENTRY(nearest_neighbour) },
+	{ FILTER_TABLE_ENTRY(bilinear)          },
+	{ FILTER_TABLE_ENTRY(bicubic)           },
+};
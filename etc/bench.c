@@ -0,0 +1,510 @@
+/*
+ * headless benchmark for the hot sxcs kernels, see etc/bench.mk.
+ *
+ *	$ ./sxcs-bench                   # scaling, filters and color kernels
+ *	$ ./sxcs-bench e2e ./sxcs [args] # warp -> cursor update, needs $DISPLAY
+ *	$ ./sxcs-bench activate ./sxcs [args] # launch -> first loupe, ditto
+ *
+ * Results are printed as TAB separated lines, one per case, so that runs from
+ * different commits can simply be diffed.
+ *
+ * This file is part of sxcs, see sxcs.c for copyright and license details.
+ */
+
+#define main sxcs_main
+#include "../sxcs.c"
+#undef main
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <X11/extensions/Xfixes.h>
+
+/* minimum amount of time to spend on each case */
+#ifndef BENCH_NS
+	#define BENCH_NS  (200L * 1000 * 1000)
+#endif
+
+typedef struct {
+	XImage im;
+	Image img;
+	XcursorImage *out;
+} Frame;
+
+static long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static ulong
+rng(void)
+{
+	static ulong s = 0x2545F491;
+	s ^= s << 13; s &= 0xFFFFFFFF;
+	s ^= s >> 17;
+	s ^= s << 5;  s &= 0xFFFFFFFF;
+	return s;
+}
+
+static void
+report(const char *kernel, const char *param, uint size, float factor,
+       const char *clip, long ns, long iter, ulong pixels)
+{
+	double per = (double)ns / (double)iter;
+	printf("%s\t%s\t%u\t%.2f\t%s\t%.0f\t%.1f\n", kernel, param, size, factor,
+	       clip, per, (double)pixels / per * 1000.0);
+}
+
+/*
+ * mimics magnify(): a `c x c` capture around the cursor, clipped at the top
+ * left corner of the screen when `clip` is set.
+ */
+static void
+frame_init(Frame *f, uint size, float factor, int clip, int byte_order)
+{
+	const uint c = (uint)((float)size / factor);
+	size_t i, n;
+
+	memset(f, 0, sizeof *f);
+	f->img.wanted.w = f->img.wanted.h = c;
+	f->img.w = f->img.h = clip ? c - c/3 : c;
+	f->img.cx = f->img.cy = (int)(clip ? c/6 : c/2);
+	f->im.width = (int)f->img.w;
+	f->im.height = (int)f->img.h;
+	f->im.depth = 24;
+	f->im.bits_per_pixel = 32;
+	f->im.bytes_per_line = f->im.width * 4;
+	f->im.byte_order = byte_order;
+	f->im.format = ZPixmap;
+	n = (size_t)f->im.bytes_per_line * f->img.h;
+	if ((f->im.data = malloc(n)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < n; ++i)
+		f->im.data[i] = (char)rng();
+	f->img.im = &f->im;
+	if ((f->out = XcursorImageCreate((int)size, (int)size)) == NULL)
+		fatal("failed to create cursor image");
+}
+
+static void
+frame_free(Frame *f)
+{
+	free(f->im.data);
+	XcursorImageDestroy(f->out);
+}
+
+static void
+bench_scale(void)
+{
+	static const uint sizes[] = { 128, 192, 256, 512 };
+	static const float factors[] = { 1.1f, 2.0f, 3.0f, 8.0f };
+	uint fn, si, fi, clip, bo;
+
+	for (fn = 0; fn < ARRLEN(MAG_FUNC_TABLE); ++fn)
+	for (si = 0; si < ARRLEN(sizes); ++si)
+	for (fi = 0; fi < ARRLEN(factors); ++fi)
+	for (clip = 0; clip < 2; ++clip)
+	for (bo = 0; bo < 2; ++bo) {
+		Frame f;
+		long t, iter;
+		frame_init(&f, sizes[si], factors[fi], (int)clip, bo ? MSBFirst : LSBFirst);
+		MAG_FUNC_TABLE[fn].f(f.out, &f.img); /* warm up the tables */
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			MAG_FUNC_TABLE[fn].f(f.out, &f.img);
+		report(
+			(char *)MAG_FUNC_TABLE[fn].str.s, bo ? "msb" : "lsb",
+			sizes[si], factors[fi], clip ? "clip" : "full",
+			now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+		);
+		frame_free(&f);
+	}
+}
+
+/* zoomed out, the capture is bigger than the loupe */
+static void
+bench_minify(void)
+{
+	static const float factors[] = { 0.1f, 0.25f, 0.5f, 0.9f };
+	uint fi;
+
+	for (fi = 0; fi < ARRLEN(factors); ++fi) {
+		Frame f;
+		long t, iter;
+		const uint c = (uint)(192.0f / factors[fi]);
+		frame_init(&f, 192, factors[fi], 0, LSBFirst);
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			area_average(f.out, &f.img);
+		report(
+			"area_average", "lsb", 192, factors[fi], "full",
+			now_ns() - t, iter, (ulong)c * c
+		);
+		frame_free(&f);
+	}
+}
+
+static void
+bench_filter(void)
+{
+	static const uint sizes[] = { 128, 192, 256 };
+	uint fn, si;
+
+	for (si = 0; si < ARRLEN(sizes); ++si) {
+		XcursorImage *img = XcursorImageCreate((int)sizes[si], (int)sizes[si]);
+		long t, iter;
+
+		if (img == NULL)
+			fatal("failed to create cursor image");
+		for (fn = 0; fn < ARRLEN(FILTER_TABLE); ++fn) {
+			for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+				FILTER_TABLE[fn].f(img);
+			report(
+				(char *)FILTER_TABLE[fn].str.s, "-", sizes[si], 0.0f, "-",
+				now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+			);
+		}
+		/* the default sequence, as magnify() applies it */
+		overlay.valid = 0;
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			filter_apply(img);
+		report(
+			"filter_apply", "default", sizes[si], 0.0f, "-",
+			now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+		);
+		XcursorImageDestroy(img);
+	}
+}
+
+/* the scanline converters, a screen wide row of each format */
+static void
+bench_conv(void)
+{
+	static const char *const name[PIX_COUNT] = {
+		"32_lsb", "32_msb", "30_lsb", "30_msb", "16_lsb", "16_msb"
+	};
+	enum { N = 1920 };
+	static uchar src[N * 4];
+	static XcursorPixel dst[N];
+	uint i;
+
+	for (i = 0; i < ARRLEN(src); ++i)
+		src[i] = (uchar)rng();
+	for (i = 0; i < PIX_COUNT; ++i) {
+		long t, iter;
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			kern.conv[i](dst, src, N);
+		report("conv", name[i], N, 0.0f, "-", now_ns() - t, iter, N);
+	}
+}
+
+/* the dedupe hash, over the capture of a frame_init() loupe */
+static void
+bench_hash(void)
+{
+	static const uint sizes[] = { 128, 192, 256, 512 };
+	static const float factors[] = { 1.1f, 2.0f, 8.0f };
+	uint si, fi;
+	ulong sink = 0;
+
+	for (si = 0; si < ARRLEN(sizes); ++si)
+	for (fi = 0; fi < ARRLEN(factors); ++fi) {
+		Frame f;
+		long t, iter;
+		frame_init(&f, sizes[si], factors[fi], 0, LSBFirst);
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			sink ^= frame_hash(&f.img, &f.img, factors[fi], 1, 0, 0, False);
+		report(
+			"frame_hash", "-", sizes[si], factors[fi], "full",
+			now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+		);
+		frame_free(&f);
+	}
+	if (sink == 1) /* keep it from getting optimized out */
+		putchar('\0');
+}
+
+static void
+bench_color(void)
+{
+	enum { N = 192 * 192 };
+	static ulong px[N];
+	static float val[N * 3];
+	uint i;
+
+	for (i = 0; i < N; ++i)
+		px[i] = rng() & 0xFFFFFF;
+	for (i = 0; i < ARRLEN(COLOR_SPACE); ++i) {
+		long t, iter;
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			color_convert(val, px, N, COLOR_SPACE[i].fmt);
+		report(
+			"color_convert", COLOR_SPACE[i].label, 192, 0.0f, "-",
+			now_ns() - t, iter, N
+		);
+	}
+}
+
+/* --sample, over a capture the size of the box as it is for large boxes,
+ * and over a zoomed out one */
+static void
+bench_sample(void)
+{
+	static const uint sizes[] = { 15, 64, 301 };
+	uint si, med;
+
+	for (med = 0; med < 2; ++med)
+	for (si = 0; si < ARRLEN(sizes); ++si) {
+		Frame f;
+		long t, iter;
+		frame_init(&f, sizes[si], 1.0f, 0, LSBFirst);
+		sample.median = (Bool)med;
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			sample_update(&f.img, sizes[si]);
+		report(
+			"sample", med ? "median" : "mean", sizes[si], 0.0f, "-",
+			now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+		);
+		frame_free(&f);
+	}
+	{ /* zoomed out all the way, the capture dwarfs the box */
+		Frame f;
+		long t, iter;
+		frame_init(&f, MAG_SIZE, MAG_FACTOR_MIN, 0, LSBFirst);
+		sample.median = False;
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter)
+			sample_update(&f.img, SAMPLE_MAX);
+		report(
+			"sample", "mean", SAMPLE_MAX, MAG_FACTOR_MIN, "-",
+			now_ns() - t, iter, (ulong)SAMPLE_MAX * SAMPLE_MAX
+		);
+		frame_free(&f);
+	}
+	sample.median = False;
+}
+
+/* --palette over a screen sized capture, without the printing */
+static void
+bench_palette(void)
+{
+	static PalBucket h[1 << 15];
+	static ushort ent[1 << 15];
+	static const uint sizes[] = { 256, 2160 };
+	PalBox box[256];
+	uint si, i, nent = 0;
+
+	for (si = 0; si < ARRLEN(sizes); ++si) {
+		Frame f;
+		long t, iter;
+		frame_init(&f, sizes[si], 1.0f, 0, LSBFirst);
+		for (iter = 0, t = now_ns(); now_ns() - t < BENCH_NS; ++iter) {
+			memset(h, 0, sizeof h);
+			palette_hist(h, &f.img);
+			for (nent = 0, i = 0; i < ARRLEN(h); ++i) {
+				if (h[i].n > 0)
+					ent[nent++] = (ushort)i;
+			}
+			palette_cut(h, ent, nent, box, ARRLEN(box));
+		}
+		report(
+			"palette", "256", sizes[si], 0.0f, "-",
+			now_ns() - t, iter, (ulong)sizes[si] * sizes[si]
+		);
+		frame_free(&f);
+	}
+}
+
+static int
+cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static Display *
+cursor_watch(int *ev_base)
+{
+	Display *dpy;
+	int err_base;
+
+	if ((dpy = XOpenDisplay(NULL)) == NULL)
+		fatal("failed to open x11 display");
+	if (!XFixesQueryExtension(dpy, ev_base, &err_base))
+		fatal("XFixes not available");
+	XFixesSelectCursorInput(dpy, DefaultRootWindow(dpy), XFixesDisplayCursorNotifyMask);
+	XSync(dpy, False);
+	return dpy;
+}
+
+/* waits up to `ms` for the cursor image to change, returns whether it did */
+static int
+cursor_wait(Display *dpy, int ev_base, int ms)
+{
+	struct pollfd pfd;
+	XEvent ev;
+	int got = 0;
+
+	pfd.fd = ConnectionNumber(dpy);
+	pfd.events = POLLIN;
+	while (!got && (XPending(dpy) > 0 || poll(&pfd, 1, ms) > 0)) {
+		while (XPending(dpy) > 0) {
+			XNextEvent(dpy, &ev);
+			got |= ev.type == ev_base + XFixesCursorNotify;
+		}
+	}
+	return got;
+}
+
+static pid_t
+spawn(char *argv[])
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		fatal("fork: %s", strerror(errno));
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+/*
+ * spawns sxcs and measures the time from warping the pointer until the
+ * server reports the cursor image changing. meant to be ran against Xvfb.
+ */
+static int
+bench_e2e(char *argv[])
+{
+	enum { N = 500, TIMEOUT = 1000 };
+	static long lat[N];
+	Display *dpy;
+	Window root;
+	pid_t pid;
+	int ev_base, n, i, missed = 0;
+
+	if (argv[0] == NULL)
+		fatal("e2e: no sxcs command given");
+	dpy = cursor_watch(&ev_base);
+	root = DefaultRootWindow(dpy);
+	pid = spawn(argv);
+
+	for (n = 0, i = -1; n < N; ++i) {
+		int w = DisplayWidth(dpy, DefaultScreen(dpy));
+		int h = DisplayHeight(dpy, DefaultScreen(dpy));
+		long t0;
+		int got;
+
+		XWarpPointer(dpy, None, root, 0, 0, 0, 0, (int)(rng() % (ulong)w), (int)(rng() % (ulong)h));
+		XFlush(dpy);
+		t0 = now_ns();
+		got = cursor_wait(dpy, ev_base, TIMEOUT);
+		if (i < 0) /* first one is sxcs starting up and grabbing the pointer */
+			continue;
+		if (got)
+			lat[n++] = now_ns() - t0;
+		else if (++missed > 10)
+			fatal("e2e: no cursor updates, is sxcs running?");
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	XCloseDisplay(dpy);
+
+	qsort(lat, N, sizeof *lat, cmp_long);
+	printf("e2e\twarp->cursor\tp50\t%ld\tp90\t%ld\tp99\t%ld\tmax\t%ld\tmissed\t%d\n",
+	       lat[N/2], lat[N*9/10], lat[N*99/100], lat[N-1], missed);
+	return 0;
+}
+
+/*
+ * time from launching sxcs until the loupe first shows up, started from
+ * scratch vs through `--client` with a `--daemon` already running, the last
+ * one with `--stats` on the daemon, which has to survive its clients.
+ */
+static int
+bench_activate(char *argv[])
+{
+	enum { N = 50, ARGS_MAX = 64, TIMEOUT = 2000 };
+	static const char *const name[] = { "cold", "client", "client-stats" };
+	static long lat[ARRLEN(name)][N];
+	char *cmd[ARGS_MAX + 2], *dcmd[ARGS_MAX + 3];
+	Display *dpy;
+	int ev_base, argc, mode, n;
+
+	if (argv[0] == NULL)
+		fatal("activate: no sxcs command given");
+	for (argc = 1; argv[argc] != NULL; ++argc) {
+		if (argc == ARGS_MAX)
+			fatal("activate: too many arguments");
+		cmd[argc + 1] = argv[argc];
+	}
+	cmd[argc + 1] = NULL;
+	cmd[0] = argv[0];
+	cmd[1] = "--client";
+	dpy = cursor_watch(&ev_base);
+
+	for (mode = 0; mode < (int)ARRLEN(name); ++mode) {
+		pid_t daemon = -1;
+
+		if (mode > 0) {
+			struct timespec ts = { 0, 500L * 1000 * 1000 };
+			int i, k = 0;
+
+			dcmd[k++] = argv[0];
+			dcmd[k++] = "--daemon";
+			if (mode == 2)
+				dcmd[k++] = "--stats";
+			for (i = 1; i <= argc; ++i)
+				dcmd[k++] = argv[i];
+			daemon = spawn(dcmd);
+			nanosleep(&ts, NULL); /* let it settle and start listening */
+		}
+		for (n = 0; n < N; ++n) {
+			long t0 = now_ns();
+			pid_t pid = spawn(mode > 0 ? cmd : argv);
+			if (!cursor_wait(dpy, ev_base, TIMEOUT))
+				fatal("activate: no cursor updates, is sxcs running?");
+			lat[mode][n] = now_ns() - t0;
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			while (cursor_wait(dpy, ev_base, 50)) /* back to the old cursor */
+				;
+			/* a client falls back to a cold start, which would go unnoticed */
+			if (daemon > 0 && waitpid(daemon, NULL, WNOHANG) != 0)
+				fatal("activate: the %s daemon died", name[mode]);
+		}
+		qsort(lat[mode], N, sizeof *lat[mode], cmp_long);
+		printf("activate\t%s\tp50\t%ld\tp90\t%ld\tmax\t%ld\n",
+		       name[mode], lat[mode][N/2], lat[mode][N*9/10], lat[mode][N-1]);
+		if (daemon > 0) {
+			kill(daemon, SIGTERM);
+			waitpid(daemon, NULL, 0);
+		}
+	}
+	XCloseDisplay(dpy);
+	return 0;
+}
+
+extern int
+main(int argc, char *argv[])
+{
+	kernels_init();
+	color_init();
+	if (argc > 1 && strcmp(argv[1], "e2e") == 0)
+		return bench_e2e(argv + 2);
+	if (argc > 1 && strcmp(argv[1], "activate") == 0)
+		return bench_activate(argv + 2);
+
+	printf("kernel\tparam\tsize\tfactor\tclip\tns/frame\tMpixel/s\n");
+	bench_scale();
+	bench_minify();
+	bench_filter();
+	bench_conv();
+	bench_hash();
+	bench_color();
+	bench_sample();
+	bench_palette();
+	return 0;
+}
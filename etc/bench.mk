@@ -0,0 +1,38 @@
+# benchmark harness for the scaling, filter and color kernels:
+#	$ make -f etc/bench.mk            # headless, no X server needed
+#	$ make -f etc/bench.mk bench-e2e  # warp -> cursor update under Xvfb
+#	$ make -f etc/bench.mk bench-e2e DEPTH=16  # or 30, other pixel formats
+#	$ make -f etc/bench.mk bench-activate # cold start vs --daemon/--client
+#	$ make -f etc/bench.mk bench-replay REC=session.rec # an sxcs --record session
+#
+# output is TAB separated, redirect it to a file and diff between commits.
+
+CC     = cc
+CFLAGS = -O3 -pthread
+LIBS   = -l X11 -l Xcursor -l Xrender -l Xcomposite -l Xext -l Xdamage -l X11-xcb -l xcb -l xcb-shm -l Xrandr -l Xfixes -l m
+DISP   = :99
+DEPTH  = 24
+ARGS   = --color-none
+REC    = sxcs.rec
+
+bench: sxcs-bench
+	@./sxcs-bench
+bench-e2e: sxcs-bench sxcs
+	Xvfb $(DISP) -screen 0 1920x1080x$(DEPTH) -nolisten tcp & pid=$$!; \
+	sleep 1; DISPLAY=$(DISP) ./sxcs-bench e2e ./sxcs $(ARGS); \
+	ret=$$?; kill $$pid; exit $$ret
+bench-activate: sxcs-bench sxcs
+	Xvfb $(DISP) -screen 0 1920x1080x$(DEPTH) -nolisten tcp & pid=$$!; \
+	sleep 1; DISPLAY=$(DISP) ./sxcs-bench activate ./sxcs $(ARGS); \
+	ret=$$?; kill $$pid; exit $$ret
+bench-replay: sxcs
+	Xvfb $(DISP) -screen 0 1920x1080x$(DEPTH) -nolisten tcp & pid=$$!; \
+	sleep 1; DISPLAY=$(DISP) ./sxcs --replay $(REC) $(ARGS); \
+	ret=$$?; kill $$pid; exit $$ret
+
+sxcs-bench: etc/bench.c sxcs.c config.h
+	$(CC) -o $@ etc/bench.c $(CFLAGS) $(LIBS)
+sxcs: sxcs.c config.h
+	$(CC) -o $@ sxcs.c $(CFLAGS) $(LIBS)
+
+.PHONY: bench bench-e2e bench-activate bench-replay
@@ -20,18 +20,43 @@
 #define _POSIX_C_SOURCE 200112L /* NOLINT */
 
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/cursorfont.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xcomposite.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+	#define HAVE_X86_SIMD 1
+	#include <immintrin.h>
+#endif
 
 /*
  * macros
@@ -45,6 +70,7 @@
 #define MAX(A, B)        ((A) > (B) ? (A) : (B))
 #define MIN(A, B)        ((A) < (B) ? (A) : (B))
 #define DIFF(A, B)       ((A) > (B) ? (A) - (B) : (B) - (A))
+#define CLAMP(X, LO, HI) ((X) < (LO) ? (LO) : ((X) > (HI) ? (HI) : (X)))
 #define UNUSED(X)        ((void)(X))
 /* not correct. but works fine for our usecase in this program */
 #define ROUNDF(X)        ((int)((X) + 0.50f))
@@ -96,6 +122,11 @@ enum output {
 	OUTPUT_HEX = 1 << 0,
 	OUTPUT_RGB = 1 << 1,
 	OUTPUT_HSL = 1 << 2,
+	OUTPUT_HSV = 1 << 3,
+	OUTPUT_LINEAR = 1 << 4,
+	OUTPUT_LAB = 1 << 5,
+	OUTPUT_OKLAB = 1 << 6,
+	OUTPUT_OKLCH = 1 << 7,
 	OUTPUT_ALL = OUTPUT_HEX | OUTPUT_RGB | OUTPUT_HSL
 };
 
@@ -110,6 +141,15 @@ typedef struct {
 	uint quit_on_keypress  : 1;
 	uint no_mag            : 1;
 	uint keyboard          : 1;
+	uint mag_window        : 1;
+	uint threaded          : 1;
+	uint freeze            : 1;
+	uint batch             : 1;
+	uint daemon            : 1;
+	uint client            : 1;
+	uint watch;   /* --watch rate in Hz, 0 if disabled */
+	uint palette; /* --palette size, 0 if disabled */
+	const char *record, *replay; /* paths, NULL if disabled */
 	enum output fmt;
 } Options;
 
@@ -120,6 +160,124 @@ typedef struct {
 	struct { uint w, h; } wanted; /* w, h if no clipping occurred */
 } Image;
 
+typedef struct {
+	int *off; /* first source tap, relative to the cursor position */
+	int *w;   /* `taps` weights per entry, 8bit fixed point */
+	uint out_len, in_len, taps;
+} ScaleTab;
+
+typedef struct { void *p; size_t cap; } Buf;
+
+/* a GetImage request, possibly still in flight. see capture_get() */
+typedef struct {
+	Image img;     /* img.im is valid once the reply is in */
+	Bool window;   /* requested for --mag-window */
+	Bool busy;
+	uint seq;      /* cookie sequence */
+	XImage *shm;   /* NULL if MIT-SHM isn't usable */
+	XShmSegmentInfo info;
+	XImage view;   /* wraps `reply` otherwise */
+	xcb_get_image_reply_t *reply;
+} Capture;
+
+/* top-level window, as seen by the --mag-window capture */
+typedef struct {
+	Window id;
+	int x, y;
+	uint w, h;
+	Picture pic;
+	Bool viewable;
+	Bool argb;
+} TopLevel;
+
+/*
+ * XImage formats the scanline converters handle, see ximg_conv(). the byte
+ * order gets added to the LSBFirst one.
+ */
+enum pixfmt {
+	PIX_32_LSB, PIX_32_MSB, /* 32bpp, 8 bits per channel (depth 24 or 32) */
+	PIX_30_LSB, PIX_30_MSB, /* 32bpp, 10 bits per channel (depth 30) */
+	PIX_16_LSB, PIX_16_MSB, /* 16bpp, 5-6-5 (depth 16) */
+	PIX_COUNT
+};
+
+/* convert `n` XImage pixels to opaque ARGB */
+typedef void (*PixelConv)(XcursorPixel *dst, const uchar *src, uint n);
+
+#define HASH_LANES 32 /* of kern.hash, a multiple of its SIMD versions' width */
+#define HASH_P1    0x9E3779B1u
+#define HASH_P2    0x85EBCA77u
+#define ROTL32(X, N) ((X) << (N) | (X) >> (32 - (N)))
+
+/* hot pixel loops, picked at startup by kernels_init() */
+typedef struct {
+	PixelConv conv[PIX_COUNT];
+	/* dst[i] = src[idx[i]] */
+	void (*gather)(XcursorPixel *dst, const XcursorPixel *src, const int *idx, uint n);
+	/* folds `n` bytes into the HASH_LANES states in `acc`, see frame_hash() */
+	void (*hash)(uint *acc, const uchar *src, size_t n);
+} Kernels;
+
+/*
+ * lock-free single producer, single consumer slot where the latest value
+ * wins. indexes 3 buffers: the producer's, the consumer's and one in the
+ * middle which either side swaps theirs with.
+ */
+typedef struct {
+	uint back, front; /* owned by the producer and the consumer respectively */
+	uint mid;
+} Mailbox;
+
+/* --threaded: event thread -> render thread */
+typedef struct {
+	int x, y;
+	float factor;
+	uint sample;
+	Time time;
+	ulong coalesced; /* motion events so far, the render thread owns `stats` */
+} InputState;
+
+/* --threaded: render thread -> event thread */
+typedef struct {
+	XcursorImage *img;
+	Cursor cur; /* None once handed over to the pointer grab */
+	ulong color; /* the --sample result, if `sampled` */
+	Bool sampled;
+} FrameBuf;
+
+/* --batch: a point (or its --sample box) or a rectangle from stdin */
+typedef struct {
+	XRectangle r; /* in root coordinates */
+	ulong color;
+} BatchEntry;
+
+/* --palette: a 15bit histogram bucket, 5 bits per channel */
+typedef struct {
+	ulong n;       /* pixels */
+	ulong r, g, b; /* sums of the exact channel values */
+} PalBucket;
+
+/* --palette: a median cut box, over a range of bucket indexes */
+typedef struct {
+	uint lo, hi;
+	ulong n;
+} PalBox;
+
+/* --stats/--trace */
+enum stage {
+	STAGE_CAPTURE, STAGE_SCALE, STAGE_SAMPLE, STAGE_FILTER, STAGE_UPLOAD,
+	STAGE_GRAB, STAGE_FRAME, STAGE_LATENCY, STAGE_COUNT
+};
+
+/* log-linear histogram of microseconds, 4 buckets per power of two */
+typedef struct {
+	ulong bucket[124];
+	ulong count, sum, max;
+} Hist;
+
+/* `n` pixels to 3 floats each, written `stride` floats apart */
+typedef void (*ColorConv)(float *dst, size_t stride, const ulong *src, size_t n);
+
 typedef void (*FilterFunc)(XcursorImage *img);
 typedef void (*MagFunc)(XcursorImage *out, const Image *in);
 
@@ -144,13 +302,16 @@ typedef struct {
  * cx,cy of the input and it must fill any of the clipped area with transparent
  * pixel (0xff000000).
  */
-/* TODO: add bicubic scaling */
 static void nearest_neighbour(XcursorImage *out, const Image *in);
+static void bilinear(XcursorImage *out, const Image *in);
+static void bicubic(XcursorImage *out, const Image *in);
 /*
  * filter functions:
  *
  * The filter functions are given a pointer to `XcursorImage` as input. There
  * is no output, the functions can modify it's input as it wants.
+ * Sequences that only depend on the image size are rendered once and cached,
+ * see overlay_build().
  */
 /* TODO: add pixels_grid */
 static void square(XcursorImage *img);
@@ -163,23 +324,171 @@ static void circle(XcursorImage *img);
  */
 
 static struct {
-	Display *dpy;
+	Display *dpy;   /* rendering */
+	Display *input; /* grabs and events, same as `dpy` unless --threaded */
 	Cursor cur;
 	uint grab_mask;
 	struct {
 		Window win;
 		uint w, h;
 	} root;
+	struct {
+		xcb_connection_t *c;
+		Capture slot[2]; /* the one being rendered and the next frame's */
+		Capture *inflight;
+		uint next;
+		uint reserved; /* largest capture the buffers hold, see capture_reserve() */
+		XImage tmpl; /* format of the captures */
+	} cap;
+	struct {
+		Damage d;
+		int ev_base;
+		XRectangle area; /* last captured area */
+	} damage;
+	struct {
+		struct {
+			Pixmap pix;
+			Picture pic;
+			XImage *im; /* NULL if MIT-SHM isn't usable */
+			XShmSegmentInfo info;
+			Bool busy;  /* server hasn't finished reading `im` yet */
+		} slot[3];
+		XImage *plain; /* wraps cursor_img->pixels */
+		GC gc;
+		uint next;
+		int shm_ev;
+	} upload;
+	struct {
+		Window win;
+		Picture pic;
+		Pixmap dst;       /* the capture gets composited into this */
+		Picture dst_pic;
+		Picture root_pic;
+		TopLevel *tl;
+		uint ntl, tl_cap;
+		Window *stack;    /* the root's children bottom to top, see mwin_compose() */
+		uint nstack;
+		Bool stack_valid;
+		int render_err;
+		XErrorHandler xerror_prev;
+	} mwin;
+	struct {
+		Bool on, quit;
+		Bool fresh; /* input was picked up early by capture_prefetch() */
+		pthread_t tid;
+		int wake[2]; /* event -> render thread */
+		int done[2]; /* render -> event thread */
+		Mailbox in, out;
+		InputState input[3];
+		FrameBuf frame[3];
+	} thr;
+	int xerror;
 	struct {
 		uint cur         : 1;
 		uint ungrab_ptr  : 1;
 		uint ungrab_kb   : 1;
+		uint cap         : 1;
+		uint damage      : 1;
+		uint upload      : 1;
+		uint mwin_mapped : 1;
 	} valid;
 } x11;
 
 static XcursorImage *cursor_img;
 
+/* output of the filter sequence, when it doesn't depend on the frame content */
+static struct {
+	XcursorPixel *px;
+	uint *span; /* [start, end) pairs of pixels covered by the overlay */
+	uint w, h, nspan;
+	uint valid    : 1;
+	uint dynamic  : 1;
+} overlay;
+
+/* scrolling capture cache, see cache_get() */
+static struct {
+	uchar *px;
+	size_t stride;
+	uint bpp;           /* bytes per pixel */
+	uint cap_w, cap_h;  /* allocated size */
+	XRectangle r;       /* cached area, in root coordinates */
+	ulong stamp;        /* when `r` was last fetched in whole */
+	int last_x, last_y; /* pointer position on the previous frame */
+	float vx, vy;       /* pointer speed, in pixels per frame */
+	Image img;
+	XImage view;        /* points into `px` */
+	uint on     : 1;
+	uint valid  : 1;
+} cache;
+
+/* --freeze: the whole root, captured once at startup */
+static struct {
+	XImage *im;  /* NULL unless --freeze */
+	Bool shm;    /* `im` is a shared segment, see freeze_init() */
+	XShmSegmentInfo info;
+	Image img;
+	XImage view; /* points into `im` */
+} freeze;
+
+/* --palette: the selection, outlined with an XOR rectangle */
+static struct {
+	Bool on, drawn;
+	int ax, ay; /* anchor */
+	XRectangle r;
+	GC gc;
+} sel;
+
+/* --sample, see sample_update() */
+static struct {
+	uint n;       /* box size, 1 is just the pixel under the pointer */
+	Bool median;
+	Bool valid;   /* `color` is for the last frame */
+	ulong color;
+	Buf sat, row;
+} sample = { 1, False, False, 0, { NULL, 0 }, { NULL, 0 } };
+
+static struct {
+	Bool on, print;
+	FILE *trace; /* NULL unless --trace */
+	Bool trace_sep;
+	ulong start;
+	long skew_min; /* local minus server clock in ms, see stats_motion() */
+	Bool skew_valid;
+	Hist hist[STAGE_COUNT];
+	ulong idle, coalesced, fetched, deduped;
+} stats;
+
 static volatile sig_atomic_t sig_recieved;
+static int sig_pipe[2] = { -1, -1 }; /* written to by sighandler() */
+
+/* --daemon, see srv_run() */
+static struct {
+	Bool on;
+	Bool gone;  /* the client went away, end its session */
+	int fd;     /* listening socket */
+	int client; /* the current session's, -1 if none */
+	struct sockaddr_un addr;
+	jmp_buf *parse; /* set while parsing a request, see die() */
+} srv = { False, False, -1, -1, { 0 }, NULL };
+
+/* frame pacing, see pace_init() */
+static struct {
+	ulong period; /* us, one refresh of the fastest monitor */
+	ulong last;   /* us, when the last frame was drawn */
+	ulong hash;   /* of the last frame, see frame_hash() */
+	Bool valid;   /* `hash` is of the loupe currently on screen */
+	uint still;   /* frames in a row that didn't change anything */
+} pace;
+
+/* --record/--replay, see record_open() and replay_open() */
+static struct {
+	FILE *fp;     /* NULL unless --record */
+	Bool replay;
+	uchar *buf;   /* --replay: the whole file */
+	size_t len, pos;
+	ulong time;   /* of the last event, as recorded */
+	int x, y;     /* and its position */
+} rec;
 
 #include "config.h"
 
@@ -189,6 +498,16 @@ static const FilterSeq *filter = &filter_default;
  * function implementation
  */
 
+/* exit(1), unless it's a --daemon parsing a request, which only drops it */
+ATTR_NORETURN
+static void
+die(void)
+{
+	if (srv.parse != NULL)
+		longjmp(*srv.parse, 1);
+	exit(1);
+}
+
 ATTR_NORETURN ATTR_FMT(printf, 1, 2)
 static void
 fatal(const char *fmt, ...)
@@ -203,7 +522,7 @@ fatal(const char *fmt, ...)
 		vfprintf(stderr, fmt, ap);
 	va_end(ap);
 	fwrite("\n", 1, 1, stderr);
-	exit(1);
+	die();
 }
 
 static Str
@@ -237,6 +556,8 @@ str_tok(Str *s, Str *t, uchar ch)
 	return l != 0;
 }
 
+#ifdef DEBUG
+/* the reference for color_hsl() */
 static HSL
 rgb_to_hsl(ulong col)
 {
@@ -280,276 +601,3658 @@ rgb_to_hsl(ulong col)
 	ret.s = (uchar)s;
 	return ret;
 }
+#endif
 
 /*
- * NOTE: calling XGetPixel is expensive. so manually extract the pixels
- * instead. it *should* work fine, but only tested it on my system. so it's
- * possible that this causes some problems, especially if the X server is
- * running on some funny config.
+ * color engine: converts arrays of pixels at once, to 3 floats per pixel in
+ * each of the derived spaces. The per channel work (sRGB decoding, the
+ * divisions by 255) is looked up from tables built by color_init(), what's
+ * left is straight line float math over the array. rgb_to_hsl() stays as
+ * the reference, color_hsl() must agree with it exactly.
  */
-static ulong
-ximg_pixel_get(const XImage *img, int x, int y)
+static struct {
+	float lin[256];    /* sRGB -> linear */
+	int k255[256];     /* v * 1000 / 255 */
+	uchar light[511];  /* HSL lightness, by max + min */
+} ctab;
+
+/* hue as rgb_to_hsl() rounds it. POSIX guarantees 32bit int, unlike C89 */
+static int
+color_hue(int r, int g, int b, int max, int d)
 {
-	const size_t off = ((size_t)y * (size_t)img->bytes_per_line) + ((size_t)x * 4);
-	const uchar *const p = (uchar *)img->data + off;
-	ASSERT(x >= 0); ASSERT(y >= 0);
+	int h;
 
-	if (img->byte_order == MSBFirst) {
-		return (ulong)p[0] << 24 |
-		       (ulong)p[1] << 16 |
-		       (ulong)p[2] <<  8 |
-		       (ulong)p[3] <<  0;
-	} else {
-		return (ulong)p[3] << 24 |
-		       (ulong)p[2] << 16 |
-		       (ulong)p[1] <<  8 |
-		       (ulong)p[0] <<  0;
-	}
+	if (max == r)
+		h = ((g - b) * 1000) / d + (g < b ? 6000 : 0);
+	else if (max == g)
+		h = ((b - r) * 1000) / d + 2000;
+	else
+		h = ((r - g) * 1000) / d + 4000;
+	h *= 6;
+	h = (h / 100) + (h % 100 >= 50);
+	return h < 0 ? h + 360 : h;
 }
 
-static ulong
-get_pixel(int x, int y)
+static void
+color_hsl(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	ulong ret;
+	size_t i;
 
-	if (cursor_img != NULL) {
-		uint m = cursor_img->height / 2;
-		ret = cursor_img->pixels[m * cursor_img->width + m];
-		ret &= 0x00ffffff; /* cut off the alpha */
-	} else {
-		XImage *im = XGetImage(x11.dpy, x11.root.win, x, y, 1, 1, AllPlanes, ZPixmap);
-		if (im == NULL)
-			fatal("failed to get image");
-		ret = ximg_pixel_get(im, 0, 0);
-		XDestroyImage(im);
-	}
+	for (i = 0; i < n; ++i, dst += stride) {
+		const int r = (int)R(src[i]), g = (int)G(src[i]), b = (int)B(src[i]);
+		const int max = MAX(MAX(r, g), b), min = MIN(MIN(r, g), b);
+		const int l = ctab.light[max + min];
+		int s = 0, h = 0;
 
-	return ret;
+		if (max != min) {
+			const int M = ctab.k255[max], m = ctab.k255[min];
+			s = ((M - m) * 1000) / (l <= 50 ? M + m : 2000 - M - m);
+			s = (s / 10) + (s % 10 >= 5);
+			h = color_hue(r, g, b, max, max - min);
+		}
+		dst[0] = (float)h;
+		dst[1] = (float)s;
+		dst[2] = (float)l;
+	}
 }
 
+/* rounded the same way as color_hsl() */
 static void
-print_color(int x, int y, enum output fmt)
+color_hsv(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	ulong pix;
+	size_t i;
 
-	if (fmt == OUTPUT_NONE)
-		return;
+	for (i = 0; i < n; ++i, dst += stride) {
+		const int r = (int)R(src[i]), g = (int)G(src[i]), b = (int)B(src[i]);
+		const int max = MAX(MAX(r, g), b), min = MIN(MIN(r, g), b);
+		const int v = ctab.k255[max];
+		int s = 0, h = 0;
 
-	pix = get_pixel(x, y);
-	if (fmt & OUTPUT_HEX)
-		fprintf(stdout, "hex:\t#%.6lX\t", pix);
-	if (fmt & OUTPUT_RGB)
-		fprintf(stdout, "rgb:\t%lu %lu %lu\t", R(pix), G(pix), B(pix));
-	if (fmt & OUTPUT_HSL) {
-		HSL tmp = rgb_to_hsl(pix);
-		fprintf(stdout, "hsl:\t%u %u %u\t", tmp.h, tmp.s, tmp.l);
+		if (max != min) {
+			s = ((max - min) * 1000) / max;
+			s = (s / 10) + (s % 10 >= 5);
+			h = color_hue(r, g, b, max, max - min);
+		}
+		dst[0] = (float)h;
+		dst[1] = (float)s;
+		dst[2] = (float)((v / 10) + (v % 10 >= 5));
 	}
-	fwrite("\n", 1, 1, stdout);
-	fflush(stdout);
-	if (ferror(stdout))
-		fatal("writing to stdout failed");
 }
 
-ATTR_NORETURN
 static void
-usage(void)
+color_linear(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	char s[] =
-		"usage: "PROGNAME" [options]\n"
-		"See the manpage for more details.\n"
-	;
-	fwrite(s, 1, sizeof s - 1, stderr);
-	exit(1);
+	size_t i;
+
+	for (i = 0; i < n; ++i, dst += stride) {
+		dst[0] = ctab.lin[R(src[i])];
+		dst[1] = ctab.lin[G(src[i])];
+		dst[2] = ctab.lin[B(src[i])];
+	}
 }
 
-ATTR_NORETURN
-static void
-version(void)
+/* cube root, to float precision, several times faster than pow() */
+static float
+cbrt_f(float x)
 {
-	char s[] =
-		PROGNAME" v1.1.0\n\n"
-		"Copyright (C) 2022-2024 NRK and contributors.\n"
-		"License: GPLv3+ <https://gnu.org/licenses/gpl.html>.\n"
-		"Upstream: <https://codeberg.org/NRK/sxcs>\n"
-	;
-	fwrite(s, 1, sizeof s - 1, stderr);
-	exit(1);
+	unsigned int i;
+	float y;
+	int k;
+
+	if (x <= 0.0f)
+		return 0.0f;
+	/* a third of the exponent is a good enough first guess for Newton */
+	memcpy(&i, &x, sizeof i);
+	i = i / 3 + 709921077u;
+	memcpy(&y, &i, sizeof y);
+	for (k = 0; k < 3; ++k)
+		y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+	return y;
 }
 
+/* CIE L*a*b*, D65 white */
 static void
-filter_parse(Str arg)
+color_lab(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	static FilterFunc f_buf[16];
-	static FilterSeq fs_buf = FILTER_SEQ_FROM_ARRAY(f_buf);
-
-	Str tok;
-	uint i, f_len = 0;
-
-	if (arg.len == 0)
-		fatal("--mag-filters: no argument provided");
+	const float e = 216.0f / 24389.0f, k = 24389.0f / 27.0f;
+	size_t i;
+	int c;
 
-	while (str_tok(&arg, &tok, ',')) {
-		int found_match = 0;
-		for (i = 0; i < ARRLEN(FILTER_TABLE); ++i) {
-			if (str_eq(tok, FILTER_TABLE[i].str)) {
-				if (f_len >= ARRLEN(f_buf))
-					fatal("--mag-filters: too many filters");
-				f_buf[f_len++] = FILTER_TABLE[i].f;
-				found_match = 1;
-				break;
-			}
-		}
+	for (i = 0; i < n; ++i, dst += stride) {
+		const float r = ctab.lin[R(src[i])], g = ctab.lin[G(src[i])], b = ctab.lin[B(src[i])];
+		float f[3];
 
-		if (!found_match)
-			fatal("invalid filter `%.*s`", (int)tok.len, tok.s);
+		f[0] = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f;
+		f[1] = (0.2126729f * r + 0.7151522f * g + 0.0721750f * b);
+		f[2] = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f;
+		for (c = 0; c < 3; ++c)
+			f[c] = f[c] > e ? cbrt_f(f[c]) : (k * f[c] + 16.0f) / 116.0f;
+		dst[0] = 116.0f * f[1] - 16.0f;
+		dst[1] = 500.0f * (f[0] - f[1]);
+		dst[2] = 200.0f * (f[1] - f[2]);
 	}
-
-	ASSERT(arg.len == 0);
-	fs_buf.len = f_len;
-	filter = &fs_buf;
 }
 
-/* inspired by https://github.com/skeeto/scratch/blob/master/parsers/imgo.c */
-typedef struct { char **argv, *cur, *flag; int len; } OptCtx;
-#define OPT(O, SO, LO) ( ((O)->len == 1 && (SO) != 0x0 && (O)->flag[0] == (SO)) || \
-	((LO) != 0 && (O)->len-1 == sizeof(LO)-1 && memcmp(LO, (O)->flag+1, (O)->len-1) == 0) )
-static int
-opt_next(OptCtx *o)
+/* https://bottosson.github.io/posts/oklab/ */
+static void
+color_oklab(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	if (o->cur == NULL || *o->cur == '\0') {
-		if ((o->cur = *o->argv++) == NULL || *o->cur++ != '-' || *o->cur == '\0')
-			return --o->argv, 0;
-		if (*o->cur == '-') {
-			o->flag = o->cur; o->cur = NULL;
-			return o->len = (int)strlen(o->flag);
-		}
+	size_t i;
+
+	for (i = 0; i < n; ++i, dst += stride) {
+		const float r = ctab.lin[R(src[i])], g = ctab.lin[G(src[i])], b = ctab.lin[B(src[i])];
+		const float l = cbrt_f(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+		const float m = cbrt_f(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+		const float s = cbrt_f(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+		dst[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+		dst[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+		dst[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
 	}
-	o->flag = o->cur++;
-	return o->len = 1;
 }
 
-static Options
-opt_parse(int argc, char *argv[])
+/* OKLab as lightness, chroma and hue in degrees */
+static void
+color_oklch(float *dst, size_t stride, const ulong *src, size_t n)
 {
-	Options ret = {0};
-	int fmt_default = 1;
-	OptCtx o[1] = {0};
-
-	for (o->argv = argv + (argc > 0); opt_next(o);) { /* NOLINTBEGIN(*misleading-indentation) */
-		     if (OPT(o, 0x0, "rgb"))  ret.fmt |= OUTPUT_RGB;
-		else if (OPT(o, 0x0, "hex"))  ret.fmt |= OUTPUT_HEX;
-		else if (OPT(o, 0x0, "hsl"))  ret.fmt |= OUTPUT_HSL;
-		else if (OPT(o, 0x0, "color-none"))  ret.fmt = fmt_default = 0;
-		else if (OPT(o, 'o', "one-shot"))    ret.oneshot = 1;
-		else if (OPT(o, 'q', "quit-on-keypress"))  ret.quit_on_keypress = 1;
-		else if (OPT(o, 'k', "keyboard"))  ret.keyboard = 1;
-		else if (OPT(o, 0x0, "mag-none"))  ret.no_mag = 1;
-		else if (OPT(o, 0x0, "mag-filters"))  filter_parse(str_from_cstr(*o->argv++));
-		else if (OPT(o, 'h', "help"))     usage();
-		else if (OPT(o, 0x0, "version"))  version();
-		else fatal("unknown argument `-%.*s`", (int)o->len, o->flag);
-	} /* NOLINTEND(*misleading-indentation) */
-	if (*o->argv)
-		fatal("excess argument: `%s`", *o->argv);
+	size_t i;
 
-	if (ret.fmt == OUTPUT_NONE && fmt_default)
-		ret.fmt = OUTPUT_DEFAULT;
-
-	if (ret.quit_on_keypress && ret.keyboard)
-		fatal("--quit-on-keypress and --keyboard cannot be enabled at the same time");
+	color_oklab(dst, stride, src, n);
+	for (i = 0; i < n; ++i, dst += stride) {
+		const float a = dst[1], b = dst[2];
+		float h = (float)(atan2((double)b, (double)a) * (180.0 / 3.14159265358979323846));
 
-	return ret;
+		dst[1] = (float)sqrt((double)(a * a + b * b));
+		/* grays have no hue, and would only show rounding noise */
+		dst[2] = dst[1] < 1e-4f ? 0.0f : (h < 0.0f ? h + 360.0f : h);
+	}
 }
 
-static void
-nearest_neighbour(XcursorImage *out, const Image *in)
+/* in the order they're printed, see color_format() */
+static const struct {
+	enum output fmt;
+	const char *label;
+	ColorConv conv;
+	int prec; /* decimal places */
+} COLOR_SPACE[] = {
+	{ OUTPUT_HSL,    "hsl",    color_hsl,    0 },
+	{ OUTPUT_HSV,    "hsv",    color_hsv,    0 },
+	{ OUTPUT_LINEAR, "linear", color_linear, 4 },
+	{ OUTPUT_LAB,    "lab",    color_lab,    2 },
+	{ OUTPUT_OKLAB,  "oklab",  color_oklab,  4 },
+	{ OUTPUT_OKLCH,  "oklch",  color_oklch,  4 },
+};
+
+/* converts `src[n]` into each space in `fmt`, returns the floats per pixel */
+static size_t
+color_convert(float *dst, const ulong *src, size_t n, enum output fmt)
 {
-	uint x, y;
-	float ocy = (float)out->height / 2.0f;
-	float ocx = (float)out->width / 2.0f;
-	float icy = (float)in->wanted.h / 2.0f;
-	float icx = (float)in->wanted.w / 2.0f;
-
-	for (y = 0; y < out->height; ++y) {
-		for (x = 0; x < out->width; ++x) {
-			float oy = ((float)y - ocy) / ocy;
-			float ox = ((float)x - ocx) / ocx;
-			int iy = ROUNDF((float)in->cy + (icy * oy));
-			int ix = ROUNDF((float)in->cx + (icx * ox));
-			ulong tmp;
-
-			if ((iy < 0 || iy >= (int)in->h) || (ix < 0 || ix >= (int)in->w))
-				tmp = 0xff000000;
-			else
-				tmp = ximg_pixel_get(in->im, ix, iy) | 0xff000000;
-			out->pixels[y * out->width + x] = (XcursorPixel)tmp;
+	size_t i, stride = 0;
+
+	for (i = 0; i < ARRLEN(COLOR_SPACE); ++i)
+		stride += (fmt & COLOR_SPACE[i].fmt) ? 3 : 0;
+	for (i = 0; i < ARRLEN(COLOR_SPACE); ++i) {
+		if (fmt & COLOR_SPACE[i].fmt) {
+			COLOR_SPACE[i].conv(dst, stride, src, n);
+			dst += 3;
 		}
 	}
+	return stride;
 }
 
+#ifdef DEBUG
 static void
-square(XcursorImage *img)
+color_check(void)
 {
-	size_t i, k;
-	const uint b = SQUARE_WIDTH;
+	ulong c;
 
-	i = 0;
-	while (i < img->width * b + b) /* draw the top border + 1 left side */
-		img->pixels[i++] = SQUARE_COLOR;
-	do {
-		i += img->width - b * 2; /* skip the mid */
-		for (k = 0; k < b*2; ++k)
-			img->pixels[i++] = SQUARE_COLOR;
-	} while (i < (img->height - b) * img->width);
-	while (i < img->width * img->height) /* draw the rest */
-		img->pixels[i++] = SQUARE_COLOR;
+	for (c = 0; c <= 0xFFFFFF; c += 997) {
+		HSL ref = rgb_to_hsl(c);
+		float got[3];
+		color_hsl(got, 3, &c, 1);
+		if ((float)ref.h != got[0] || (float)ref.s != got[1] || (float)ref.l != got[2])
+			fatal("color: hsl mismatch for #%.6lX", c);
+	}
 }
+#endif
 
 static void
-xhair(XcursorImage *img)
+color_init(void)
 {
-	uint x, y;
-	const uint c = img->height / 2;
-	const uint b = XHAIR_SIZE;
-	const uint bw = XHAIR_BORDER_WIDTH ;
+	int i;
 
-	for (y = c - b; y <= c + b; ++y) {
-		for (x = c - b; x <= c + b; ++x) {
-			if (DIFF(x, c) > b - bw || DIFF(y, c) > b - bw)
-				img->pixels[y * img->width + x] = XHAIR_COLOR;
-		}
+	for (i = 0; i < 256; ++i) {
+		const double v = i / 255.0;
+		ctab.lin[i] = (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+		ctab.k255[i] = (i * 1000) / 255;
 	}
+	for (i = 0; i < 511; ++i) {
+		const int l = (i * 500) / 255;
+		ctab.light[i] = (uchar)((l / 10) + (l % 10 >= 5));
+	}
+#ifdef DEBUG
+	color_check();
+#endif
 }
 
-static void
-grid(XcursorImage *img)
+static void *
+buf_get(Buf *b, size_t size)
 {
-	uint x, y;
-	const uint z = GRID_SIZE;
-	const uint c = (img->height / 2) + (z / 2);
-
-	for (y = 0; y < img->height; ++y) {
-		if (DIFF(c, y) % z == 0) {
-			for (x = 0; x < img->width; ++x)
-				img->pixels[y * img->width + x] = GRID_COLOR;
-		} else for (x = c % z; x < img->width; x += z) {
-			img->pixels[y * img->width + x] = GRID_COLOR;
-		}
+	if (size > b->cap) {
+		free(b->p);
+		if ((b->p = malloc(size)) == NULL)
+			fatal("out of memory");
+		b->cap = size;
 	}
+	return b->p;
 }
 
+/*
+ * pixel kernels: the portable C89 versions below are the reference, the SIMD
+ * versions must produce bit-identical output.
+ */
 static void
-four_point_draw(XcursorImage *img, uint x, uint y, XcursorPixel col) /* naming is hard */
+conv_lsb(XcursorPixel *dst, const uchar *src, uint n)
 {
-	uint w = img->width, h = img->height;
-	ASSERT(x <= w/2); ASSERT(y <= h/2);
-	img->pixels[y * w + x] = col;
-	img->pixels[y * w + (w - x - 1)] = col;
-	img->pixels[(h - y - 1) * w + x] = col;
-	img->pixels[(h - y - 1) * w + (w - x - 1)] = col;
+	uint i;
+	for (i = 0; i < n; ++i, src += 4) {
+		dst[i] = (XcursorPixel)0xff000000 | (XcursorPixel)src[2] << 16 |
+		         (XcursorPixel)src[1] << 8 | (XcursorPixel)src[0];
+	}
 }
 
-/* TODO: reduce jaggedness */
+static void
+conv_msb(XcursorPixel *dst, const uchar *src, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i, src += 4) {
+		dst[i] = (XcursorPixel)0xff000000 | (XcursorPixel)src[1] << 16 |
+		         (XcursorPixel)src[2] << 8 | (XcursorPixel)src[3];
+	}
+}
+
+/* the top 8 of each 10 bits, which round trips 8bit content */
+static void
+conv_30_lsb(XcursorPixel *dst, const uchar *src, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i, src += 4) {
+		ulong v = (ulong)src[3] << 24 | (ulong)src[2] << 16 | (ulong)src[1] << 8 | src[0];
+		dst[i] = (XcursorPixel)0xff000000 | (XcursorPixel)(v >> 6 & 0xff0000) |
+		         (XcursorPixel)(v >> 4 & 0xff00) | (XcursorPixel)(v >> 2 & 0xff);
+	}
+}
+
+static void
+conv_30_msb(XcursorPixel *dst, const uchar *src, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i, src += 4) {
+		ulong v = (ulong)src[0] << 24 | (ulong)src[1] << 16 | (ulong)src[2] << 8 | src[3];
+		dst[i] = (XcursorPixel)0xff000000 | (XcursorPixel)(v >> 6 & 0xff0000) |
+		         (XcursorPixel)(v >> 4 & 0xff00) | (XcursorPixel)(v >> 2 & 0xff);
+	}
+}
+
+/* 5 and 6 bit channels get their top bits repeated, so that 0x1F is 0xFF */
+static XcursorPixel
+conv_565(uint v)
+{
+	const uint r = v >> 11, g = v >> 5 & 0x3F, b = v & 0x1F;
+	return (XcursorPixel)0xff000000 | (XcursorPixel)(r << 3 | r >> 2) << 16 |
+	       (XcursorPixel)(g << 2 | g >> 4) << 8 | (XcursorPixel)(b << 3 | b >> 2);
+}
+
+static void
+conv_16_lsb(XcursorPixel *dst, const uchar *src, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i, src += 2)
+		dst[i] = conv_565((uint)src[1] << 8 | src[0]);
+}
+
+static void
+conv_16_msb(XcursorPixel *dst, const uchar *src, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i, src += 2)
+		dst[i] = conv_565((uint)src[0] << 8 | src[1]);
+}
+
+static void
+gather(XcursorPixel *dst, const XcursorPixel *src, const int *idx, uint n)
+{
+	uint i;
+	for (i = 0; i < n; ++i)
+		dst[i] = src[idx[i]];
+}
+
+/*
+ * xxHash style lanes over 32bit little-endian words, dealt out round robin.
+ * Every word gets multiplied in, rather than summed, so that what's in a lane
+ * can't be shuffled around without it showing; plain sums (and sums of sums)
+ * miss e.g A,B,B,A turning into B,A,A,B, which text and blinking do a lot.
+ * The lanes are independent so that the SIMD versions aren't stuck waiting
+ * on the multiply.
+ */
+static void
+hash_lanes(uint *acc, const uchar *src, size_t n)
+{
+	uchar tail[HASH_LANES * 4];
+	size_t i, k;
+
+	for (i = 0; i < n; i += sizeof tail) {
+		const uchar *p = src + i;
+		if (n - i < sizeof tail) { /* zero padded */
+			memset(tail, 0, sizeof tail);
+			memcpy(tail, p, n - i);
+			p = tail;
+		}
+		for (k = 0; k < HASH_LANES; ++k, p += 4) {
+			uint w = (uint)p[3] << 24 | (uint)p[2] << 16 | (uint)p[1] << 8 | p[0];
+			uint t = acc[k] + w * HASH_P2;
+			acc[k] = ROTL32(t, 13) * HASH_P1;
+		}
+	}
+}
+
+#if HAVE_X86_SIMD
+/* x86 is little-endian, so LSBFirst pixels can be loaded as is */
+__attribute__ ((target("sse2")))
+static void
+conv_lsb_sse2(XcursorPixel *dst, const uchar *src, uint n)
+{
+	const __m128i a = _mm_set1_epi32((int)0xff000000);
+	uint i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(src + i*4));
+		_mm_storeu_si128((__m128i *)(void *)(dst + i), _mm_or_si128(v, a));
+	}
+	conv_lsb(dst + i, src + i*4, n - i);
+}
+
+__attribute__ ((target("sse2")))
+static void
+conv_msb_sse2(XcursorPixel *dst, const uchar *src, uint n)
+{
+	const __m128i a = _mm_set1_epi32((int)0xff000000);
+	const __m128i m = _mm_set1_epi32(0xff00);
+	uint i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(src + i*4));
+		/* the alpha byte gets overwritten anyways, so only swap the rest */
+		v = _mm_or_si128(
+			_mm_or_si128(_mm_srli_epi32(v, 24), _mm_and_si128(_mm_srli_epi32(v, 8), m)),
+			_mm_slli_epi32(_mm_and_si128(v, m), 8)
+		);
+		_mm_storeu_si128((__m128i *)(void *)(dst + i), _mm_or_si128(v, a));
+	}
+	conv_msb(dst + i, src + i*4, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void
+conv_lsb_avx2(XcursorPixel *dst, const uchar *src, uint n)
+{
+	const __m256i a = _mm256_set1_epi32((int)0xff000000);
+	uint i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(src + i*4));
+		_mm256_storeu_si256((__m256i *)(void *)(dst + i), _mm256_or_si256(v, a));
+	}
+	conv_lsb(dst + i, src + i*4, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void
+conv_msb_avx2(XcursorPixel *dst, const uchar *src, uint n)
+{
+	const __m256i a = _mm256_set1_epi32((int)0xff000000);
+	const __m256i bswap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+	);
+	uint i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(src + i*4));
+		v = _mm256_shuffle_epi8(v, bswap);
+		_mm256_storeu_si256((__m256i *)(void *)(dst + i), _mm256_or_si256(v, a));
+	}
+	conv_msb(dst + i, src + i*4, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void
+gather_avx2(XcursorPixel *dst, const XcursorPixel *src, const int *idx, uint n)
+{
+	uint i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i vi = _mm256_loadu_si256((const __m256i *)(const void *)(idx + i));
+		__m256i v = _mm256_i32gather_epi32((const int *)(const void *)src, vi, 4);
+		_mm256_storeu_si256((__m256i *)(void *)(dst + i), v);
+	}
+	gather(dst + i, src, idx + i, n - i);
+}
+
+/* SSE2 has no 32bit multiply, it's put together from the 64bit ones */
+__attribute__ ((target("sse2")))
+static __m128i
+mullo_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))
+	);
+}
+
+__attribute__ ((target("sse2")))
+static void
+hash_lanes_sse2(uint *acc, const uchar *src, size_t n)
+{
+	const __m128i p1 = _mm_set1_epi32((int)HASH_P1), p2 = _mm_set1_epi32((int)HASH_P2);
+	__m128i a[HASH_LANES / 4];
+	uchar tail[HASH_LANES * 4];
+	size_t i, k;
+
+	for (k = 0; k < ARRLEN(a); ++k)
+		a[k] = _mm_loadu_si128((const __m128i *)(const void *)(acc + k * 4));
+	for (i = 0; i < n; i += sizeof tail) {
+		const uchar *p = src + i;
+		if (n - i < sizeof tail) { /* zero padded, as hash_lanes() does */
+			memset(tail, 0, sizeof tail);
+			memcpy(tail, p, n - i);
+			p = tail;
+		}
+		for (k = 0; k < ARRLEN(a); ++k) {
+			__m128i w = _mm_loadu_si128((const __m128i *)(const void *)(p + k * 16));
+			__m128i t = _mm_add_epi32(a[k], mullo_sse2(w, p2));
+			t = _mm_or_si128(_mm_slli_epi32(t, 13), _mm_srli_epi32(t, 19));
+			a[k] = mullo_sse2(t, p1);
+		}
+	}
+	for (k = 0; k < ARRLEN(a); ++k)
+		_mm_storeu_si128((__m128i *)(void *)(acc + k * 4), a[k]);
+}
+
+__attribute__ ((target("avx2")))
+static void
+hash_lanes_avx2(uint *acc, const uchar *src, size_t n)
+{
+	const __m256i p1 = _mm256_set1_epi32((int)HASH_P1), p2 = _mm256_set1_epi32((int)HASH_P2);
+	__m256i a[HASH_LANES / 8];
+	uchar tail[HASH_LANES * 4];
+	size_t i, k;
+
+	for (k = 0; k < ARRLEN(a); ++k)
+		a[k] = _mm256_loadu_si256((const __m256i *)(const void *)(acc + k * 8));
+	for (i = 0; i < n; i += sizeof tail) {
+		const uchar *p = src + i;
+		if (n - i < sizeof tail) { /* zero padded, as hash_lanes() does */
+			memset(tail, 0, sizeof tail);
+			memcpy(tail, p, n - i);
+			p = tail;
+		}
+		for (k = 0; k < ARRLEN(a); ++k) {
+			__m256i w = _mm256_loadu_si256((const __m256i *)(const void *)(p + k * 32));
+			__m256i t = _mm256_add_epi32(a[k], _mm256_mullo_epi32(w, p2));
+			t = _mm256_or_si256(_mm256_slli_epi32(t, 13), _mm256_srli_epi32(t, 19));
+			a[k] = _mm256_mullo_epi32(t, p1);
+		}
+	}
+	for (k = 0; k < ARRLEN(a); ++k)
+		_mm256_storeu_si256((__m256i *)(void *)(acc + k * 8), a[k]);
+}
+#endif /* HAVE_X86_SIMD */
+
+static Kernels kern = {
+	{ conv_lsb, conv_msb, conv_30_lsb, conv_30_msb, conv_16_lsb, conv_16_msb },
+	gather, hash_lanes
+};
+
+/*
+ * NOTE: calling XGetPixel is expensive. so the pixels are extracted manually
+ * instead, by a converter for `im`'s format. it's picked once per capture so
+ * that the pixel loops don't have to look at the format at all.
+ */
+static PixelConv
+ximg_conv(const XImage *im)
+{
+	enum pixfmt f;
+
+	if (im->bits_per_pixel == 32 && (im->depth == 24 || im->depth == 32))
+		f = PIX_32_LSB;
+	else if (im->bits_per_pixel == 32 && im->depth == 30)
+		f = PIX_30_LSB;
+	else if (im->bits_per_pixel == 16 && im->depth == 16)
+		f = PIX_16_LSB;
+	else
+		fatal("unexpected XImage format");
+	return kern.conv[f + (im->byte_order == MSBFirst)];
+}
+
+/* scanlines may be padded, so rows are always addressed via bytes_per_line */
+static uchar *
+ximg_at(const XImage *im, uint x, uint y)
+{
+	return (uchar *)im->data + (size_t)y * (size_t)im->bytes_per_line +
+	       (size_t)x * (size_t)(im->bits_per_pixel / 8);
+}
+
+/* the color of a single pixel, without alpha */
+static ulong
+ximg_pixel_get(const XImage *im, int x, int y)
+{
+	XcursorPixel p;
+
+	ASSERT(x >= 0); ASSERT(y >= 0);
+	ximg_conv(im)(&p, ximg_at(im, (uint)x, (uint)y), 1);
+	return p & 0xFFFFFF;
+}
+
+#ifdef DEBUG
+/* cross check the selected kernels against the reference ones */
+static void
+kernels_check(void)
+{
+	enum { N = 67 };
+	uchar src[N * 4];
+	XcursorPixel ref[N], got[N], lut[N];
+	int idx[N];
+	uint i, k;
+
+	for (i = 0; i < ARRLEN(src); ++i)
+		src[i] = (uchar)(i * 151 + 7);
+	for (i = 0; i < N; ++i) {
+		idx[i] = (int)((i * 37) % N);
+		lut[i] = (XcursorPixel)(i * 0x01030507);
+	}
+	for (k = 0; k < 2; ++k) {
+		(k ? conv_msb : conv_lsb)(ref, src, N);
+		kern.conv[k](got, src, N);
+		if (memcmp(ref, got, sizeof ref) != 0)
+			fatal("kernels: conv[%u] mismatch", k);
+	}
+	gather(ref, lut, idx, N);
+	kern.gather(got, lut, idx, N);
+	if (memcmp(ref, got, sizeof ref) != 0)
+		fatal("kernels: gather mismatch");
+	memset(ref, 0, sizeof ref);
+	memset(got, 0, sizeof got);
+	hash_lanes(ref, src, sizeof src);
+	kern.hash(got, src, sizeof src);
+	if (memcmp(ref, got, HASH_LANES * sizeof *ref) != 0)
+		fatal("kernels: hash mismatch");
+}
+#endif
+
+static void
+kernels_init(void)
+{
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kern.conv[PIX_32_LSB] = conv_lsb_avx2;
+		kern.conv[PIX_32_MSB] = conv_msb_avx2;
+		kern.gather = gather_avx2;
+		kern.hash = hash_lanes_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kern.conv[PIX_32_LSB] = conv_lsb_sse2;
+		kern.conv[PIX_32_MSB] = conv_msb_sse2;
+		kern.hash = hash_lanes_sse2;
+	}
+#endif
+#ifdef DEBUG
+	kernels_check();
+#endif
+}
+
+/*
+ * --stats/--trace: timing of each stage of magnify() and of the motion to
+ * cursor update latency. All the hooks bail out on `!stats.on` first, so
+ * leaving them disabled costs a well predicted branch per stage.
+ */
+static const char *const STAGE_NAME[STAGE_COUNT] = {
+	"capture", "scale", "sample", "filter", "upload", "grab", "frame", "latency"
+};
+
+/* microseconds, wraps around. only differences are meaningful */
+static ulong
+stats_now(void)
+{
+	struct timespec ts;
+
+	if (!stats.on)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong)ts.tv_sec * 1000000UL + (ulong)ts.tv_nsec / 1000;
+}
+
+static uint
+hist_index(ulong us)
+{
+	uint e;
+
+	if (us < 8)
+		return (uint)us;
+	for (e = 3; e < 31 && (us >> (e + 1)) != 0; ++e) {}
+	return 4 * (e - 1) + (uint)((us >> (e - 2)) & 3);
+}
+
+static ulong
+hist_lower(uint i)
+{
+	return i < 8 ? i : (ulong)(4 + i % 4) << (i / 4 - 1);
+}
+
+static ulong
+hist_pct(const Hist *h, uint pct)
+{
+	ulong want = (h->count * pct + 99) / 100, n = 0;
+	uint i;
+
+	for (i = 0; i < ARRLEN(h->bucket); ++i) {
+		if ((n += h->bucket[i]) >= want)
+			return MIN(hist_lower(i + 1) - 1, h->max);
+	}
+	return h->max;
+}
+
+/* record stage `s` as having started at `t0`, returns the current time */
+static ulong
+stats_record(enum stage s, ulong t0)
+{
+	ulong t, d;
+	Hist *h = stats.hist + s;
+
+	if (!stats.on)
+		return 0;
+	t = stats_now();
+	d = t - t0;
+	++h->bucket[hist_index(d)];
+	++h->count;
+	h->sum += d;
+	h->max = MAX(h->max, d);
+	if (stats.trace != NULL) {
+		/* latency overlaps the frames, keep it on it's own track */
+		fprintf(
+			stats.trace, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+			"\"tid\":%d,\"ts\":%lu,\"dur\":%lu}", stats.trace_sep ? "," : "",
+			STAGE_NAME[s], s == STAGE_LATENCY ? 2 : 1, t0 - stats.start, d
+		);
+		stats.trace_sep = True;
+	}
+	return t;
+}
+
+/*
+ * `time` is the server timestamp of a motion event, call with `drawn` set
+ * once the cursor has been updated for it. The offset between the server's
+ * clock and ours is unknown, so the smallest one seen (i.e the fastest
+ * delivered event) is taken as zero latency. Anything on top of that, such
+ * as events sitting in our queue, shows up in the result.
+ */
+static void
+stats_motion(Time time, Bool drawn)
+{
+	struct timespec ts;
+	ulong d;
+	long skew;
+
+	if (!stats.on)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	d = ((ulong)ts.tv_sec * 1000 + (ulong)ts.tv_nsec / 1000000 - (ulong)time) & 0xFFFFFFFFUL;
+	skew = d < 0x80000000UL ? (long)d : -(long)(0xFFFFFFFFUL - d) - 1;
+	if (!stats.skew_valid || skew < stats.skew_min) {
+		stats.skew_min = skew;
+		stats.skew_valid = True;
+	}
+	if (drawn)
+		stats_record(STAGE_LATENCY, stats_now() - (ulong)(skew - stats.skew_min) * 1000);
+}
+
+static void
+trace_open(const char *path)
+{
+	if (path == NULL)
+		fatal("--trace: no argument provided");
+	if ((stats.trace = fopen(path, "w")) == NULL)
+		fatal("--trace: failed to open `%s`: %s", path, strerror(errno));
+	fputs("{\"traceEvents\":[", stats.trace);
+	stats.on = True;
+}
+
+static void
+stats_dump(void)
+{
+	uint i;
+
+	if (stats.trace != NULL) {
+		fputs("\n]}\n", stats.trace);
+		if (fclose(stats.trace) != 0)
+			fprintf(stderr, PROGNAME ": --trace: failed to write: %s\n", strerror(errno));
+		stats.trace = NULL;
+	}
+	if (!stats.print)
+		return;
+
+	fprintf(
+		stderr, "%lu frames (%lu deduped), %lu idle redraws, %lu coalesced motion events\n"
+		"%lu pixels fetched per frame, paced at %.1f Hz\n"
+		"%-8s %8s %8s %8s %8s %8s %8s (us)\n",
+		stats.hist[STAGE_FRAME].count, stats.deduped, stats.idle, stats.coalesced,
+		stats.fetched / MAX(stats.hist[STAGE_FRAME].count, 1),
+		1e6 / (double)MAX(pace.period, 1),
+		"stage", "count", "mean", "p50", "p90", "p99", "max"
+	);
+	for (i = 0; i < STAGE_COUNT; ++i) {
+		const Hist *h = stats.hist + i;
+		if (h->count == 0)
+			continue;
+		fprintf(
+			stderr, "%-8s %8lu %8lu %8lu %8lu %8lu %8lu\n", STAGE_NAME[i],
+			h->count, h->sum / h->count, hist_pct(h, 50), hist_pct(h, 90),
+			hist_pct(h, 99), h->max
+		);
+	}
+
+	{ /* latency histogram, merged down to powers of two */
+		const Hist *h = stats.hist + STAGE_LATENCY;
+		ulong n[ARRLEN(h->bucket) / 4], most = 0;
+		uint lo = ARRLEN(n), hi = 0;
+
+		memset(n, 0, sizeof n);
+		for (i = 0; i < ARRLEN(h->bucket); ++i) {
+			if (h->bucket[i] == 0)
+				continue;
+			n[i / 4] += h->bucket[i];
+			most = MAX(most, n[i / 4]);
+			lo = MIN(lo, i / 4);
+			hi = MAX(hi, i / 4);
+		}
+		if (most > 0)
+			fprintf(stderr, "latency (us):\n");
+		for (i = lo; most > 0 && i <= hi; ++i) {
+			int bar = (int)(n[i] * 40 / most);
+			fprintf(
+				stderr, "%9lu - %-9lu %8lu %.*s\n", hist_lower(i * 4),
+				hist_lower(i * 4 + 4) - 1, n[i], bar,
+				"########################################"
+			);
+		}
+	}
+}
+
+static int
+xerror_catch(Display *dpy, XErrorEvent *ev)
+{
+	UNUSED(dpy);
+	x11.xerror = ev->error_code;
+	return 0;
+}
+
+/*
+ * MIT-SHM: create an XImage backed by a shared segment, returns NULL on
+ * failure. The extension may be advertised but unusable (e.g remote display),
+ * in which case XShmAttach() errors out and the callers fall back to the
+ * regular socket based requests.
+ */
+static XImage *
+shm_image_create(XShmSegmentInfo *info, Visual *vis, uint depth, uint w, uint h)
+{
+	XErrorHandler old;
+	XImage *im;
+
+	if (!XShmQueryExtension(x11.dpy))
+		return NULL;
+	im = XShmCreateImage(x11.dpy, vis, depth, ZPixmap, NULL, info, w, h);
+	if (im == NULL)
+		return NULL;
+	info->shmid = shmget(IPC_PRIVATE, (size_t)im->bytes_per_line * h, IPC_CREAT | 0600);
+	if (info->shmid < 0) {
+		XDestroyImage(im);
+		return NULL;
+	}
+	info->shmaddr = im->data = shmat(info->shmid, NULL, 0);
+	info->readOnly = False;
+
+	x11.xerror = 0;
+	old = XSetErrorHandler(xerror_catch);
+	if (info->shmaddr != (char *)-1)
+		XShmAttach(x11.dpy, info);
+	XSync(x11.dpy, False);
+	XSetErrorHandler(old);
+	/* mark for removal now, it'll be destroyed once both sides detach */
+	shmctl(info->shmid, IPC_RMID, NULL);
+
+	if (info->shmaddr == (char *)-1 || x11.xerror) {
+		if (info->shmaddr != (char *)-1)
+			shmdt(info->shmaddr);
+		im->data = NULL;
+		XDestroyImage(im);
+		return NULL;
+	}
+	return im;
+}
+
+static void
+shm_image_destroy(XShmSegmentInfo *info, XImage *im)
+{
+	XShmDetach(x11.dpy, info);
+	shmdt(info->shmaddr);
+	im->data = NULL;
+	XDestroyImage(im);
+}
+
+static ulong
+mono_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong)ts.tv_sec * 1000 + (ulong)ts.tv_nsec / 1000000;
+}
+
+static ulong
+mono_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong)ts.tv_sec * 1000000UL + (ulong)ts.tv_nsec / 1000;
+}
+
+/*
+ * Frame pacing: there's no point in drawing faster than the monitor refreshes,
+ * so frames are spaced at least a refresh apart, which also lets more motion
+ * events coalesce in between. The rate comes from RandR, the fastest of the
+ * active CRTCs, so that the loupe stays smooth on high refresh panels.
+ */
+static void
+pace_init(void)
+{
+	XRRScreenResources *res;
+	int dummy, major = 0, minor = 0, i;
+	ulong mhz = 0; /* millihertz */
+
+	pace.period = (ulong)MAX_FRAME_TIME * 1000;
+	if (!XRRQueryExtension(x11.dpy, &dummy, &dummy) ||
+	    !XRRQueryVersion(x11.dpy, &major, &minor) || (major == 1 && minor < 3))
+	{
+		return;
+	}
+	if ((res = XRRGetScreenResourcesCurrent(x11.dpy, x11.root.win)) == NULL)
+		return;
+	for (i = 0; i < res->ncrtc; ++i) {
+		XRRCrtcInfo *crtc = XRRGetCrtcInfo(x11.dpy, res, res->crtcs[i]);
+		int k;
+
+		for (k = 0; crtc != NULL && k < res->nmode; ++k) {
+			const XRRModeInfo *m = res->modes + k;
+			ulong lines = m->vTotal;
+
+			if (m->id != crtc->mode || m->hTotal == 0 || m->vTotal == 0)
+				continue;
+			if (m->modeFlags & RR_DoubleScan)
+				lines *= 2;
+			if (m->modeFlags & RR_Interlace)
+				lines /= 2;
+			mhz = MAX(mhz, (ulong)((double)m->dotClock * 1000.0 / ((double)m->hTotal * (double)lines)));
+		}
+		if (crtc != NULL)
+			XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeScreenResources(res);
+	if (mhz >= 1000) /* anything below 1Hz is bogus */
+		pace.period = 1000000000UL / mhz;
+}
+
+/*
+ * ms until the next frame is due. `idle` redraws, the periodic ones without
+ * XDamage, back off after PACE_IDLE_FRAMES of them in a row that didn't
+ * change anything: the interval doubles each time, up to PACE_IDLE_MAX.
+ */
+static int
+pace_timeout(Bool idle)
+{
+	const ulong now = mono_us();
+	ulong wait = pace.period;
+
+	if (idle) {
+		wait <<= MIN(pace.still / PACE_IDLE_FRAMES, 16);
+		wait = MIN(wait, (ulong)PACE_IDLE_MAX * 1000);
+	}
+	if (now - pace.last >= wait)
+		return 0;
+	return (int)((pace.last + wait - now + 999) / 1000);
+}
+
+/*
+ * a frame is due, returns true if it'd come out the same as the one on
+ * screen, which then stays as is.
+ */
+static Bool
+pace_frame(ulong hash)
+{
+	const Bool same = pace.valid && hash == pace.hash;
+
+	pace.still = same ? pace.still + 1 : 0;
+	pace.hash = hash;
+	pace.valid = True;
+	pace.last = mono_us();
+	return same;
+}
+
+/* a murmur3 round */
+static uint
+hash_round(uint h, uint w)
+{
+	w *= 0xCC9E2D51;
+	w = ROTL32(w, 15) * 0x1B873593;
+	h ^= w;
+	return ROTL32(h, 13) * 5 + 0xE6546B64;
+}
+
+static uint
+hash_final(uint h)
+{
+	h ^= h >> 16; h *= 0x85EBCA6B;
+	h ^= h >> 13; h *= 0xC2B2AE35;
+	return h ^ h >> 16;
+}
+
+/*
+ * Hash of everything the loupe gets made out of: the captured pixels, which
+ * part of them it shows and the box. The pointer position only matters for
+ * --mag-window, the cursor looks the same anywhere.
+ *
+ * The pixels go through kern.hash, which has to stay well under what a scale
+ * costs; its lanes then get mixed together.
+ */
+static ulong
+frame_hash(const Image *cap, const Image *img, float factor, uint box,
+           int x, int y, Bool window)
+{
+	const XImage *im = cap->im;
+	const size_t row = (size_t)cap->w * (size_t)(im->bits_per_pixel / 8);
+	uint acc[HASH_LANES], par[12], h[2], i;
+
+	ASSERT(sizeof(uint) == 4);
+	for (i = 0; i < ARRLEN(acc); ++i)
+		acc[i] = HASH_P1 + HASH_P2;
+	for (i = 0; i < cap->h; ++i)
+		kern.hash(acc, (const uchar *)im->data + (size_t)i * (size_t)im->bytes_per_line, row);
+
+	par[0] = cap->w; par[1] = cap->h;
+	par[2] = (uint)cap->cx; par[3] = (uint)cap->cy;
+	par[4] = img->w; par[5] = img->h;
+	par[6] = (uint)img->cx; par[7] = (uint)img->cy;
+	par[8] = img->wanted.w;
+	par[9] = box << 1 | (uint)sample.median;
+	par[10] = par[11] = 0;
+	if (box > 1) /* sample_draw() scales the outline by it */
+		memcpy(par + 10, &factor, sizeof factor);
+	if (window) {
+		par[10] ^= (uint)x;
+		par[11] = (uint)y;
+	}
+
+	h[0] = 0x9E3779B9;
+	h[1] = 0x85EBCA6B;
+	for (i = 0; i < ARRLEN(acc); ++i)
+		h[i % 2] = hash_round(h[i % 2], acc[i]);
+	for (i = 0; i < ARRLEN(par); ++i)
+		h[i % 2] = hash_round(h[i % 2], par[i]);
+	/* 64 bits where ulong has them */
+	return (ulong)hash_final(h[0]) << 16 << 16 | hash_final(h[1]);
+}
+
+static int
+rect_overlap(const XRectangle *a, const XRectangle *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+	       a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/*
+ * XDamage: only redraw when something under the magnifier actually changed,
+ * instead of re-capturing every MAX_FRAME_TIME.
+ */
+static void
+damage_init(void)
+{
+	int err_base;
+
+	if (!XDamageQueryExtension(x11.dpy, &x11.damage.ev_base, &err_base))
+		return;
+	x11.damage.d = XDamageCreate(x11.dpy, x11.root.win, XDamageReportBoundingBox);
+	x11.valid.damage = 1;
+}
+
+/* returns true if the damage intersects the last captured area */
+static int
+damage_handle(const XEvent *ev)
+{
+	const XDamageNotifyEvent *de = (const XDamageNotifyEvent *)(const void *)ev;
+
+	/* reset the bounding box so that the next damage gets reported again */
+	XDamageSubtract(x11.dpy, x11.damage.d, None, None);
+	if (cache.valid && rect_overlap(&de->area, &cache.r))
+		cache.valid = 0;
+	return rect_overlap(&de->area, &x11.damage.area);
+}
+
+/*
+ * cursor upload: XcursorImageLoadCursor() creates (and then frees) a pixmap,
+ * a GC, an XImage and a picture for every single cursor. instead keep a small
+ * ring of ARGB pixmaps and pictures around, push the pixels into them via
+ * MIT-SHM when possible and create the cursor straight from the picture.
+ */
+static void
+upload_init(XcursorImage *img)
+{
+	XRenderPictFormat *fmt;
+	int major, minor, dummy, native = 1;
+	uint i;
+
+	if (!XRenderQueryExtension(x11.dpy, &dummy, &dummy) ||
+	    !XRenderQueryVersion(x11.dpy, &major, &minor) ||
+	    (major == 0 && minor < 5) || /* cursors were added in 0.5 */
+	    (fmt = XRenderFindStandardFormat(x11.dpy, PictStandardARGB32)) == NULL)
+	{
+		return;
+	}
+
+	x11.upload.plain = XCreateImage(
+		x11.dpy, NULL, 32, ZPixmap, 0, (char *)img->pixels,
+		img->width, img->height, 32, (int)img->width * 4
+	);
+	if (x11.upload.plain == NULL)
+		fatal("failed to create image");
+	/* XPutImage() takes care of swapping, if the server needs it */
+	x11.upload.plain->byte_order = *(uchar *)&native ? LSBFirst : MSBFirst;
+
+	for (i = 0; i < ARRLEN(x11.upload.slot); ++i) {
+		x11.upload.slot[i].pix = XCreatePixmap(
+			x11.dpy, x11.root.win, img->width, img->height, 32
+		);
+		x11.upload.slot[i].pic = XRenderCreatePicture(
+			x11.dpy, x11.upload.slot[i].pix, fmt, 0, NULL
+		);
+		x11.upload.slot[i].im = shm_image_create(
+			&x11.upload.slot[i].info, NULL, 32, img->width, img->height
+		);
+	}
+	x11.upload.gc = XCreateGC(x11.dpy, x11.upload.slot[0].pix, 0, NULL);
+	x11.upload.shm_ev = XShmGetEventBase(x11.dpy) + ShmCompletion;
+	x11.valid.upload = 1;
+}
+
+/* returns the slot the pixels were uploaded into */
+static uint
+upload_pixels(const XcursorImage *img)
+{
+	uint i, k;
+
+	ASSERT(x11.valid.upload);
+	/* pick the next slot the server is done reading from */
+	for (k = 0, i = x11.upload.next; k < ARRLEN(x11.upload.slot); ++k) {
+		i = (x11.upload.next + k) % ARRLEN(x11.upload.slot);
+		if (!x11.upload.slot[i].busy)
+			break;
+	}
+	x11.upload.next = (i + 1) % ARRLEN(x11.upload.slot);
+
+	if (x11.upload.slot[i].im != NULL && !x11.upload.slot[i].busy) {
+		XImage *im = x11.upload.slot[i].im;
+		memcpy(im->data, img->pixels, (size_t)img->width * img->height * 4);
+		XShmPutImage(
+			x11.dpy, x11.upload.slot[i].pix, x11.upload.gc, im,
+			0, 0, 0, 0, img->width, img->height, True
+		);
+		x11.upload.slot[i].busy = True;
+	} else {
+		x11.upload.plain->data = (char *)img->pixels;
+		XPutImage(
+			x11.dpy, x11.upload.slot[i].pix, x11.upload.gc, x11.upload.plain,
+			0, 0, 0, 0, img->width, img->height
+		);
+	}
+	return i;
+}
+
+static Cursor
+upload_cursor(const XcursorImage *img)
+{
+	uint i;
+
+	if (!x11.valid.upload)
+		return XcursorImageLoadCursor(x11.dpy, img);
+	i = upload_pixels(img);
+	return XRenderCreateCursor(x11.dpy, x11.upload.slot[i].pic, img->xhot, img->yhot);
+}
+
+static void
+upload_complete(const XEvent *ev)
+{
+	const XShmCompletionEvent *ce = (const XShmCompletionEvent *)(const void *)ev;
+	uint i;
+
+	for (i = 0; i < ARRLEN(x11.upload.slot); ++i) {
+		if (x11.upload.slot[i].im != NULL && x11.upload.slot[i].info.shmseg == ce->shmseg)
+			x11.upload.slot[i].busy = False;
+	}
+}
+
+/*
+ * --mag-window: present the magnifier in an override-redirect ARGB window
+ * instead of the cursor, which glitches past ~255x255.
+ *
+ * The window must not end up in its own capture. So every top-level gets
+ * redirected (automatically, i.e the server keeps compositing them as usual)
+ * which gives each of them an offscreen copy of their content. The capture is
+ * then assembled by compositing the root background and the top-levels other
+ * than ours, bottom to top, into a pixmap and reading that back.
+ */
+static int
+xerror_mwin(Display *dpy, XErrorEvent *ev)
+{
+	/* top-levels can get destroyed under our feet, that's fine */
+	if (ev->error_code == BadWindow || ev->error_code == BadDrawable ||
+	    ev->error_code == x11.mwin.render_err + BadPicture)
+	{
+		return 0;
+	}
+	return x11.mwin.xerror_prev(dpy, ev);
+}
+
+/* the pixmap the capture gets composited into, as big as the largest one */
+static void
+mwin_resize(uint cap_w, uint cap_h)
+{
+	const int scr = DefaultScreen(x11.dpy);
+
+	if (x11.mwin.dst != None) {
+		XRenderFreePicture(x11.dpy, x11.mwin.dst_pic);
+		XFreePixmap(x11.dpy, x11.mwin.dst);
+	}
+	x11.mwin.dst = XCreatePixmap(
+		x11.dpy, x11.root.win, cap_w, cap_h, (uint)DefaultDepth(x11.dpy, scr)
+	);
+	x11.mwin.dst_pic = XRenderCreatePicture(
+		x11.dpy, x11.mwin.dst,
+		XRenderFindVisualFormat(x11.dpy, DefaultVisual(x11.dpy, scr)), 0, NULL
+	);
+}
+
+static void
+mwin_init(uint cap_w, uint cap_h)
+{
+	const int scr = DefaultScreen(x11.dpy);
+	int major = 0, minor = 0, dummy;
+	XVisualInfo vi;
+	XSetWindowAttributes wa;
+	XRenderPictFormat *root_fmt;
+
+	if (!XCompositeQueryExtension(x11.dpy, &dummy, &dummy) ||
+	    !XCompositeQueryVersion(x11.dpy, &major, &minor) ||
+	    (major == 0 && minor < 2))
+	{
+		fatal("--mag-window: XComposite not available");
+	}
+	if (!x11.valid.upload || !XRenderQueryExtension(x11.dpy, &dummy, &x11.mwin.render_err))
+		fatal("--mag-window: XRender not available");
+	if (!XMatchVisualInfo(x11.dpy, scr, 32, TrueColor, &vi))
+		fatal("--mag-window: no ARGB visual");
+
+	wa.override_redirect = True;
+	wa.colormap = XCreateColormap(x11.dpy, x11.root.win, vi.visual, AllocNone);
+	wa.border_pixel = 0;
+	x11.mwin.win = XCreateWindow(
+		x11.dpy, x11.root.win, 0, 0, MAG_SIZE, MAG_SIZE, 0, 32,
+		InputOutput, vi.visual, CWOverrideRedirect | CWColormap | CWBorderPixel, &wa
+	);
+	x11.mwin.pic = XRenderCreatePicture(
+		x11.dpy, x11.mwin.win, XRenderFindVisualFormat(x11.dpy, vi.visual), 0, NULL
+	);
+
+	root_fmt = XRenderFindVisualFormat(x11.dpy, DefaultVisual(x11.dpy, scr));
+	mwin_resize(cap_w, cap_h);
+	x11.mwin.root_pic = XRenderCreatePicture(x11.dpy, x11.root.win, root_fmt, 0, NULL);
+
+	/* the redirection is per session, see mwin_redirect() */
+	XSelectInput(x11.dpy, x11.root.win, SubstructureNotifyMask);
+	x11.mwin.xerror_prev = XSetErrorHandler(xerror_mwin);
+	/* the window carries the crosshair, so hide the actual cursor */
+	{
+		static char zero[1];
+		XColor col = {0};
+		Pixmap p = XCreateBitmapFromData(x11.dpy, x11.root.win, zero, 1, 1);
+		x11.cur = XCreatePixmapCursor(x11.dpy, p, p, &col, &col, 0, 0);
+		x11.valid.cur = 1;
+		XFreePixmap(x11.dpy, p);
+	}
+}
+
+/*
+ * top-levels only keep their obscured parts while redirected, which costs an
+ * offscreen copy of each and gets in the way of a compositor, so a --daemon
+ * doesn't leave them redirected in between sessions. the window pictures and
+ * the top-level cache stay valid either way.
+ */
+static void
+mwin_redirect(Bool on)
+{
+	if (on)
+		XCompositeRedirectSubwindows(x11.dpy, x11.root.win, CompositeRedirectAutomatic);
+	else
+		XCompositeUnredirectSubwindows(x11.dpy, x11.root.win, CompositeRedirectAutomatic);
+}
+
+static TopLevel *
+mwin_toplevel(Window id, Bool add)
+{
+	XWindowAttributes wa;
+	XRenderPictureAttributes pa;
+	XRenderPictFormat *fmt;
+	TopLevel *t;
+	uint i;
+
+	for (i = 0; i < x11.mwin.ntl; ++i) {
+		if (x11.mwin.tl[i].id == id)
+			return x11.mwin.tl + i;
+	}
+	if (!add || !XGetWindowAttributes(x11.dpy, id, &wa))
+		return NULL;
+
+	if (x11.mwin.ntl == x11.mwin.tl_cap) {
+		x11.mwin.tl_cap = MAX(32, x11.mwin.tl_cap * 2);
+		x11.mwin.tl = realloc(x11.mwin.tl, x11.mwin.tl_cap * sizeof *x11.mwin.tl);
+		if (x11.mwin.tl == NULL)
+			fatal("out of memory");
+	}
+	t = x11.mwin.tl + x11.mwin.ntl++;
+	t->id = id;
+	t->x = wa.x + wa.border_width;
+	t->y = wa.y + wa.border_width;
+	t->w = (uint)wa.width;
+	t->h = (uint)wa.height;
+	t->viewable = wa.map_state == IsViewable;
+	t->pic = None;
+	t->argb = False;
+	fmt = wa.class == InputOutput ? XRenderFindVisualFormat(x11.dpy, wa.visual) : NULL;
+	if (fmt != NULL) {
+		pa.subwindow_mode = IncludeInferiors;
+		t->pic = XRenderCreatePicture(x11.dpy, id, fmt, CPSubwindowMode, &pa);
+		t->argb = fmt->type == PictTypeDirect && fmt->direct.alphaMask != 0;
+	}
+	return t;
+}
+
+/*
+ * keeps the top-level cache in sync, called with the root's SubstructureNotify
+ * events. anything that may have restacked them drops the stacking order.
+ */
+static void
+mwin_event(const XEvent *ev)
+{
+	TopLevel *t;
+
+	switch (ev->type) {
+	case CreateNotify:
+	case CirculateNotify:
+		x11.mwin.stack_valid = False;
+		break;
+	case ConfigureNotify:
+		if (ev->xconfigure.window == x11.mwin.win) /* raised on every frame */
+			break;
+		x11.mwin.stack_valid = False;
+		if ((t = mwin_toplevel(ev->xconfigure.window, False)) != NULL) {
+			t->x = ev->xconfigure.x + ev->xconfigure.border_width;
+			t->y = ev->xconfigure.y + ev->xconfigure.border_width;
+			t->w = (uint)ev->xconfigure.width;
+			t->h = (uint)ev->xconfigure.height;
+		}
+		break;
+	case MapNotify:
+		if (ev->xmap.window != x11.mwin.win)
+			x11.mwin.stack_valid = False;
+		if ((t = mwin_toplevel(ev->xmap.window, False)) != NULL)
+			t->viewable = True;
+		break;
+	case UnmapNotify:
+		if ((t = mwin_toplevel(ev->xunmap.window, False)) != NULL)
+			t->viewable = False;
+		break;
+	case DestroyNotify:
+	case ReparentNotify: /* no longer a top-level, re-added lazily if needed */
+		x11.mwin.stack_valid = False;
+		/* not xany.window, that's the root the event was reported on */
+		t = mwin_toplevel(
+			ev->type == DestroyNotify ? ev->xdestroywindow.window : ev->xreparent.window,
+			False
+		);
+		if (t != NULL) {
+			if (t->pic != None)
+				XRenderFreePicture(x11.dpy, t->pic);
+			*t = x11.mwin.tl[--x11.mwin.ntl];
+		}
+		break;
+	}
+}
+
+static void
+mwin_compose(int x, int y, uint w, uint h)
+{
+	uint i;
+
+	/* root background, ClipByChildren leaves out the top-levels */
+	XRenderComposite(
+		x11.dpy, PictOpSrc, x11.mwin.root_pic, None, x11.mwin.dst_pic,
+		x, y, 0, 0, 0, 0, w, h
+	);
+	/* XQueryTree() lists the children in bottom to top stacking order. it's
+	 * a round trip, so only done again once mwin_event() saw a restack. */
+	if (!x11.mwin.stack_valid) {
+		Window dummy;
+
+		if (x11.mwin.stack != NULL)
+			XFree(x11.mwin.stack);
+		x11.mwin.stack = NULL;
+		if (XQueryTree(x11.dpy, x11.root.win, &dummy, &dummy,
+		               &x11.mwin.stack, &x11.mwin.nstack) == 0)
+		{
+			x11.mwin.stack = NULL;
+			x11.mwin.nstack = 0;
+		}
+		x11.mwin.stack_valid = True;
+	}
+	for (i = 0; i < x11.mwin.nstack; ++i) {
+		const Window win = x11.mwin.stack[i];
+		TopLevel *t;
+		int dx, dy;
+
+		if (win == x11.mwin.win || (t = mwin_toplevel(win, True)) == NULL ||
+		    !t->viewable || t->pic == None ||
+		    t->x >= x + (int)w || t->x + (int)t->w <= x ||
+		    t->y >= y + (int)h || t->y + (int)t->h <= y)
+		{
+			continue;
+		}
+		dx = MAX(x, t->x);
+		dy = MAX(y, t->y);
+		XRenderComposite(
+			x11.dpy, t->argb ? PictOpOver : PictOpSrc, t->pic, None, x11.mwin.dst_pic,
+			dx - t->x, dy - t->y, 0, 0, dx - x, dy - y,
+			(uint)(MIN(x + (int)w, t->x + (int)t->w) - dx),
+			(uint)(MIN(y + (int)h, t->y + (int)t->h) - dy)
+		);
+	}
+}
+
+/* the ring slot acts as the back buffer, present it with a single copy */
+static void
+mwin_present(const XcursorImage *img, int x, int y)
+{
+	XWindowChanges wc;
+	uint i = upload_pixels(img);
+
+	XRenderComposite(
+		x11.dpy, PictOpSrc, x11.upload.slot[i].pic, None, x11.mwin.pic,
+		0, 0, 0, 0, 0, 0, img->width, img->height
+	);
+	wc.x = x - (int)img->xhot;
+	wc.y = y - (int)img->yhot;
+	wc.stack_mode = Above;
+	XConfigureWindow(x11.dpy, x11.mwin.win, CWX | CWY | CWStackMode, &wc);
+	if (!x11.valid.mwin_mapped) {
+		XMapWindow(x11.dpy, x11.mwin.win);
+		x11.valid.mwin_mapped = 1;
+	}
+}
+
+/*
+ * --threaded: the event loop in pick() only reads input and hands the latest
+ * pointer position and zoom to a render thread, which has its own connection
+ * (`x11.dpy`) and does the capture, scaling, filtering and cursor creation.
+ * Finished frames come back through a second mailbox, and the event thread
+ * puts them on the pointer grab. Each side wakes the other up via a pipe.
+ */
+#define MBOX_NEW  4u
+
+#ifdef __GNUC__
+	#define MBOX_XCHG(P, V)  __atomic_exchange_n((P), (V), __ATOMIC_ACQ_REL)
+	#define MBOX_LOAD(P)     __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#else
+static pthread_mutex_t mbox_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint
+mbox_xchg(uint *p, uint v)
+{
+	uint ret;
+	pthread_mutex_lock(&mbox_lock);
+	ret = *p;
+	*p = v;
+	pthread_mutex_unlock(&mbox_lock);
+	return ret;
+}
+	#define MBOX_XCHG(P, V)  mbox_xchg((P), (V))
+	#define MBOX_LOAD(P)     mbox_xchg((P), *(P)) /* only the consumer loads */
+#endif
+
+static void
+mbox_init(Mailbox *m)
+{
+	m->back = 0;
+	m->mid = 1;
+	m->front = 2;
+}
+
+static void
+mbox_publish(Mailbox *m)
+{
+	m->back = MBOX_XCHG(&m->mid, m->back | MBOX_NEW) & ~MBOX_NEW;
+}
+
+/* returns true if `m->front` now points to something new */
+static Bool
+mbox_fetch(Mailbox *m)
+{
+	if (!(MBOX_LOAD(&m->mid) & MBOX_NEW))
+		return False;
+	m->front = MBOX_XCHG(&m->mid, m->front) & ~MBOX_NEW;
+	return True;
+}
+
+static void
+thr_wake(int fd)
+{
+	ssize_t ret = write(fd, "", 1); /* full pipe means a wake up is pending */
+	UNUSED(ret);
+}
+
+static void
+thr_drain(int fd)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof buf) > 0) {}
+}
+
+static void
+thr_pipe(int fd[2])
+{
+	if (pipe(fd) < 0)
+		fatal("pipe: %s", strerror(errno));
+	fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+}
+
+/* event thread, `time` is CurrentTime if it's not for a motion event */
+static void
+thr_post(int x, int y, float factor, uint box, Time time, ulong coalesced)
+{
+	InputState *in = x11.thr.input + x11.thr.in.back;
+
+	in->x = x;
+	in->y = y;
+	in->factor = factor;
+	in->sample = box;
+	in->time = time;
+	in->coalesced = coalesced;
+	mbox_publish(&x11.thr.in);
+	thr_wake(x11.thr.wake[1]);
+}
+
+/* render thread, returns true on new input */
+static Bool
+thr_input(void)
+{
+	if (!mbox_fetch(&x11.thr.in))
+		return False;
+	MAG_FACTOR = x11.thr.input[x11.thr.in.front].factor;
+	sample.n = x11.thr.input[x11.thr.in.front].sample;
+	stats.coalesced = x11.thr.input[x11.thr.in.front].coalesced;
+	return True;
+}
+
+/* render thread, `cur` is None for --mag-window */
+static void
+thr_publish(Cursor cur)
+{
+	FrameBuf *f = x11.thr.frame + x11.thr.out.back;
+
+	if (f->cur != None) /* superseded before it made it to the screen */
+		XFreeCursor(x11.dpy, f->cur);
+	f->cur = cur;
+	f->color = sample.color;
+	f->sampled = sample.valid;
+	XSync(x11.dpy, False); /* the input connection is about to refer to it */
+	mbox_publish(&x11.thr.out);
+	cursor_img = x11.thr.frame[x11.thr.out.back].img;
+	thr_wake(x11.thr.done[1]);
+}
+
+/* event thread: put the newest frame, if any, on screen */
+static void
+thr_show(void)
+{
+	FrameBuf *f = x11.thr.frame + x11.thr.out.front;
+
+	if (!(MBOX_LOAD(&x11.thr.out.mid) & MBOX_NEW))
+		return;
+	/* fine to free while the grab still uses it, the server keeps a
+	 * reference until it's replaced */
+	if (f->cur != None)
+		XFreeCursor(x11.input, f->cur);
+	f->cur = None;
+	mbox_fetch(&x11.thr.out);
+	f = x11.thr.frame + x11.thr.out.front;
+	if (f->cur != None)
+		XChangeActivePointerGrab(x11.input, x11.grab_mask, f->cur, CurrentTime);
+}
+
+/* event thread, waits for the render thread to finish its frame and quit */
+static void
+thr_stop(void)
+{
+	x11.thr.quit = True;
+	thr_wake(x11.thr.wake[1]);
+	pthread_join(x11.thr.tid, NULL);
+}
+
+static void
+thr_init(void)
+{
+	uint i;
+
+	x11.thr.frame[0].img = cursor_img;
+	for (i = 1; i < ARRLEN(x11.thr.frame); ++i) {
+		XcursorImage *img = XcursorImageCreate(MAG_SIZE, MAG_SIZE);
+		if (img == NULL)
+			fatal("failed to create cursor image");
+		img->xhot = img->yhot = MAG_SIZE / 2;
+		x11.thr.frame[i].img = img;
+	}
+	mbox_init(&x11.thr.in);
+	mbox_init(&x11.thr.out);
+	cursor_img = x11.thr.frame[x11.thr.out.back].img;
+	thr_pipe(x11.thr.wake);
+	thr_pipe(x11.thr.done);
+	x11.thr.on = True;
+}
+
+/*
+ * The capture goes over XCB so that the GetImage request for the next frame
+ * can be sent off before the current one is scaled and uploaded, instead of
+ * sitting out a round trip in XGetImage(). Each slot gets its own shared
+ * segment, big enough for the largest capture area, so that the server can
+ * write into one while we read from the other. Called again to grow them,
+ * see capture_reserve().
+ */
+static void
+capture_init(uint w, uint h)
+{
+	int scr = DefaultScreen(x11.dpy);
+	Visual *vis = DefaultVisual(x11.dpy, scr);
+	uint i, depth = (uint)DefaultDepth(x11.dpy, scr);
+	XImage *tmpl = XCreateImage(x11.dpy, vis, depth, ZPixmap, 0, NULL, 1, 1, 32, 0);
+
+	if (tmpl == NULL)
+		fatal("failed to create image");
+	if (x11.cap.inflight != NULL) { /* it's for the old segment */
+		xcb_discard_reply(x11.cap.c, x11.cap.inflight->seq);
+		x11.cap.inflight->busy = False;
+		x11.cap.inflight = NULL;
+	}
+	x11.cap.c = XGetXCBConnection(x11.dpy);
+	x11.cap.tmpl = *tmpl;
+	for (i = 0; i < ARRLEN(x11.cap.slot); ++i) {
+		Capture *cap = x11.cap.slot + i;
+		ASSERT(!cap->busy);
+		if (cap->shm != NULL)
+			shm_image_destroy(&cap->info, cap->shm);
+		cap->view = *tmpl;
+		cap->shm = shm_image_create(&cap->info, vis, depth, w, h);
+	}
+	XDestroyImage(tmpl);
+	x11.valid.cap = 1;
+}
+
+/* the c x c area centered on x,y, clipped to the screen */
+static void
+image_geometry(Image *img, int x, int y, uint c)
+{
+	const int off = c / 2;
+
+	img->x = (uint)MAX(0, x - off);
+	img->y = (uint)MAX(0, y - off);
+	img->w = MIN(c, x11.root.w - img->x);
+	img->h = MIN(c, x11.root.h - img->y);
+	img->cx = x - (int)img->x;
+	img->cy = y - (int)img->y;
+	img->wanted.w = img->wanted.h = c;
+	img->im = NULL;
+}
+
+/* the c x c part of `src` that the magnifier shows, sharing its pixels */
+static const Image *
+image_crop(Image *dst, XImage *view, const Image *src, uint c)
+{
+	const XImage *im = src->im;
+
+	if (src->wanted.w == c)
+		return src;
+	image_geometry(dst, (int)src->x + src->cx, (int)src->y + src->cy, c);
+	ASSERT(dst->x >= src->x && dst->x + dst->w <= src->x + src->w);
+	ASSERT(dst->y >= src->y && dst->y + dst->h <= src->y + src->h);
+	*view = *im;
+	view->width = (int)dst->w;
+	view->height = (int)dst->h;
+	view->data = (char *)ximg_at(im, dst->x - src->x, dst->y - src->y);
+	dst->im = view;
+	return dst;
+}
+
+static Capture *
+capture_request(const Image *img, Bool window)
+{
+	Capture *cap = x11.cap.slot + x11.cap.next;
+	Drawable d = x11.root.win;
+	int x = (int)img->x, y = (int)img->y;
+
+	ASSERT(!cap->busy);
+	x11.cap.next = (x11.cap.next + 1) % ARRLEN(x11.cap.slot);
+	cap->img = *img;
+	cap->window = window;
+	if (window) {
+		mwin_compose(x, y, img->w, img->h);
+		d = x11.mwin.dst;
+		x = y = 0;
+	}
+	if (cap->shm != NULL) {
+		cap->seq = xcb_shm_get_image(
+			x11.cap.c, (xcb_drawable_t)d, (int16_t)x, (int16_t)y,
+			(uint16_t)img->w, (uint16_t)img->h, ~(uint32_t)0,
+			XCB_IMAGE_FORMAT_Z_PIXMAP, (xcb_shm_seg_t)cap->info.shmseg, 0
+		).sequence;
+	} else {
+		cap->seq = xcb_get_image(
+			x11.cap.c, XCB_IMAGE_FORMAT_Z_PIXMAP, (xcb_drawable_t)d,
+			(int16_t)x, (int16_t)y, (uint16_t)img->w, (uint16_t)img->h,
+			~(uint32_t)0
+		).sequence;
+	}
+	xcb_flush(x11.cap.c);
+	stats.fetched += (ulong)img->w * img->h;
+	cap->busy = True;
+	x11.cap.inflight = cap;
+	return cap;
+}
+
+static void
+capture_wait(Capture *cap)
+{
+	xcb_generic_error_t *err = NULL;
+	XImage *im;
+	uint size;
+
+	ASSERT(cap->busy);
+	cap->busy = False;
+	if (x11.cap.inflight == cap)
+		x11.cap.inflight = NULL;
+	if (cap->shm != NULL) {
+		xcb_shm_get_image_cookie_t ck;
+		xcb_shm_get_image_reply_t *r;
+
+		ck.sequence = cap->seq;
+		if ((r = xcb_shm_get_image_reply(x11.cap.c, ck, &err)) == NULL)
+			fatal("failed to get image");
+		im = cap->shm;
+		im->depth = r->depth;
+		size = r->size;
+		free(r);
+	} else {
+		xcb_get_image_cookie_t ck;
+
+		ck.sequence = cap->seq;
+		free(cap->reply);
+		if ((cap->reply = xcb_get_image_reply(x11.cap.c, ck, &err)) == NULL)
+			fatal("failed to get image");
+		im = &cap->view;
+		im->data = (char *)xcb_get_image_data(cap->reply);
+		im->depth = cap->reply->depth;
+		size = (uint)xcb_get_image_data_length(cap->reply);
+	}
+	/* the server pads the scanlines as per the format, work it out from
+	 * the reply rather than guessing */
+	im->width = (int)cap->img.w;
+	im->height = (int)cap->img.h;
+	im->bytes_per_line = (int)(size / cap->img.h);
+	cap->img.im = im;
+}
+
+/*
+ * Scrolling capture cache: keep an area bigger than the magnifier's around
+ * the pointer, with a halo sized from the recent pointer speed, and serve
+ * small movements straight from memory. Once the magnifier no longer fits,
+ * the area gets re-centered: whatever is still covered is moved over and
+ * only the newly exposed strips are fetched.
+ * It's dropped on damage, so it's only enabled along with XDamage, and
+ * after CACHE_MAX_AGE as a safety net.
+ */
+static void
+cache_init(uint w, uint h)
+{
+	if (x11.cap.tmpl.bits_per_pixel % 8 != 0)
+		return;
+	cache.cap_w = w;
+	cache.cap_h = h;
+	cache.bpp = (uint)x11.cap.tmpl.bits_per_pixel / 8;
+	cache.stride = (size_t)w * cache.bpp;
+	free(cache.px); /* growing, the contents are laid out for the old stride */
+	if ((cache.px = malloc(cache.stride * h)) == NULL)
+		fatal("out of memory");
+	cache.view = x11.cap.tmpl;
+	cache.view.bytes_per_line = (int)cache.stride;
+	cache.on = 1;
+	cache.valid = 0;
+}
+
+/* fetch `r[n]` into the cache, a batch of requests goes out before waiting */
+static void
+cache_fetch(const XRectangle *r, uint n)
+{
+	Capture *cap[ARRLEN(x11.cap.slot)];
+	uint i, k, batch;
+
+	for (i = 0; i < n; i += batch) {
+		batch = MIN(n - i, ARRLEN(cap));
+		for (k = 0; k < batch; ++k) {
+			Image img = {0}; /* only the rectangle matters, the rest is copied along */
+			img.x = (uint)r[i + k].x;
+			img.y = (uint)r[i + k].y;
+			img.w = r[i + k].width;
+			img.h = r[i + k].height;
+			cap[k] = capture_request(&img, False);
+		}
+		for (k = 0; k < batch; ++k) {
+			const XRectangle *rr = r + i + k;
+			const XImage *im;
+			uchar *dst = cache.px + (size_t)(rr->y - cache.r.y) * cache.stride +
+			             (size_t)(rr->x - cache.r.x) * cache.bpp;
+			uint row;
+
+			capture_wait(cap[k]);
+			im = cap[k]->img.im;
+			if ((uint)im->bits_per_pixel != cache.bpp * 8)
+				fatal("unexpected XImage format");
+			for (row = 0; row < rr->height; ++row, dst += cache.stride)
+				memcpy(dst, ximg_at(im, 0, row), (size_t)rr->width * cache.bpp);
+			cache.view.depth = im->depth;
+		}
+	}
+}
+
+/* move the still covered part of the old area `o` to where it goes in `n` */
+static void
+cache_shift(const XRectangle *o, const XRectangle *n, const XRectangle *in)
+{
+	const size_t len = (size_t)in->width * cache.bpp;
+	const size_t src = (size_t)(in->y - o->y) * cache.stride + (size_t)(in->x - o->x) * cache.bpp;
+	const size_t dst = (size_t)(in->y - n->y) * cache.stride + (size_t)(in->x - n->x) * cache.bpp;
+	uint row;
+
+	if (dst > src) { /* moving towards the end, go backwards */
+		for (row = in->height; row-- > 0;) {
+			size_t off = (size_t)row * cache.stride;
+			memmove(cache.px + dst + off, cache.px + src + off, len);
+		}
+	} else if (dst < src) {
+		for (row = 0; row < in->height; ++row) {
+			size_t off = (size_t)row * cache.stride;
+			memmove(cache.px + dst + off, cache.px + src + off, len);
+		}
+	}
+}
+
+static const Image *
+cache_get(const Image *img, int x, int y)
+{
+	const ulong now = mono_ms();
+	XRectangle n, in, strip[4];
+	uint nstrip = 0;
+	int hx, hy, x0, y0, x1, y1;
+
+	cache.vx = 0.5f * cache.vx + 0.5f * (float)DIFF(x, cache.last_x);
+	cache.vy = 0.5f * cache.vy + 0.5f * (float)DIFF(y, cache.last_y);
+	cache.last_x = x;
+	cache.last_y = y;
+	if (cache.valid && now - cache.stamp > (ulong)CACHE_MAX_AGE)
+		cache.valid = 0;
+
+	if (!cache.valid ||
+	    (int)img->x < cache.r.x || (int)(img->x + img->w) > cache.r.x + cache.r.width ||
+	    (int)img->y < cache.r.y || (int)(img->y + img->h) > cache.r.y + cache.r.height)
+	{
+		/* enough room for a few frames worth of movement */
+		hx = (int)MIN((float)CACHE_HALO_MAX, 8.0f + 4.0f * cache.vx);
+		hy = (int)MIN((float)CACHE_HALO_MAX, 8.0f + 4.0f * cache.vy);
+		x0 = MAX(0, (int)img->x - hx);
+		y0 = MAX(0, (int)img->y - hy);
+		x1 = MIN((int)x11.root.w, (int)(img->x + img->w) + hx);
+		y1 = MIN((int)x11.root.h, (int)(img->y + img->h) + hy);
+		n.x = (short)x0;
+		n.y = (short)y0;
+		n.width = (ushort)MIN((uint)(x1 - x0), cache.cap_w);
+		n.height = (ushort)MIN((uint)(y1 - y0), cache.cap_h);
+
+		if (cache.valid && rect_overlap(&cache.r, &n)) {
+			in.x = MAX(n.x, cache.r.x);
+			in.y = MAX(n.y, cache.r.y);
+			in.width = (ushort)(MIN(n.x + n.width, cache.r.x + cache.r.width) - in.x);
+			in.height = (ushort)(MIN(n.y + n.height, cache.r.y + cache.r.height) - in.y);
+			cache_shift(&cache.r, &n, &in);
+			/* full width bands above and below, the sides in between */
+			if (in.y > n.y) {
+				strip[nstrip] = n;
+				strip[nstrip++].height = (ushort)(in.y - n.y);
+			}
+			if (in.y + in.height < n.y + n.height) {
+				strip[nstrip] = n;
+				strip[nstrip].y = (short)(in.y + in.height);
+				strip[nstrip].height = (ushort)(n.y + n.height - strip[nstrip].y);
+				++nstrip;
+			}
+			if (in.x > n.x) {
+				strip[nstrip] = in;
+				strip[nstrip].x = n.x;
+				strip[nstrip++].width = (ushort)(in.x - n.x);
+			}
+			if (in.x + in.width < n.x + n.width) {
+				strip[nstrip] = in;
+				strip[nstrip].x = (short)(in.x + in.width);
+				strip[nstrip].width = (ushort)(n.x + n.width - strip[nstrip].x);
+				++nstrip;
+			}
+		} else {
+			strip[nstrip++] = n;
+			cache.stamp = now;
+		}
+		cache.r = n;
+		cache.valid = 1;
+		cache_fetch(strip, nstrip);
+	}
+
+	cache.img = *img;
+	cache.view.width = (int)img->w;
+	cache.view.height = (int)img->h;
+	cache.view.data = (char *)cache.px +
+		(size_t)((int)img->y - cache.r.y) * cache.stride +
+		(size_t)((int)img->x - cache.r.x) * cache.bpp;
+	cache.img.im = &cache.view;
+	return &cache.img;
+}
+
+/* the largest capture at `factor` or any zoom above, --sample box included */
+static uint
+capture_max(float factor)
+{
+	return MAX((uint)((float)MAG_SIZE / factor), SAMPLE_MAX);
+}
+
+/*
+ * The buffers start out sized for 1x and above, the first zoom out past that
+ * grows them all the way to MAG_FACTOR_MIN's. Most runs never zoom out, and
+ * shouldn't pay for ~100x the segment and pixmap sizes up front.
+ */
+static void
+capture_reserve(uint c)
+{
+	const uint cw = MIN(c + 2 * CACHE_HALO_MAX, x11.root.w);
+	const uint ch = MIN(c + 2 * CACHE_HALO_MAX, x11.root.h);
+
+	x11.cap.reserved = c;
+	if (x11.valid.cap)
+		capture_init(cw, ch);
+	if (cache.on)
+		cache_init(cw, ch);
+	if (x11.mwin.win != None)
+		mwin_resize(MIN(c, x11.root.w), MIN(c, x11.root.h));
+}
+
+/*
+ * the magnifier's area, or the --sample box if that's bigger. returns false
+ * if the buffers have to grow for it first, which only capture_get() does:
+ * it's the one place nothing from the previous capture is still in use.
+ */
+static Bool
+capture_geometry(Image *img, int x, int y)
+{
+	const uint c = MAX((uint)((float)MAG_SIZE / MAG_FACTOR), sample.n);
+
+	image_geometry(img, x, y, c);
+	return c <= x11.cap.reserved;
+}
+
+/*
+ * --freeze: the screen is captured once at startup and everything after is
+ * served from that snapshot, without any further round trips. Going over
+ * MIT-SHM the server writes straight into the segment we have mapped, and
+ * detaches right after, so even an 8K or multi-monitor root is never copied
+ * or kept around twice.
+ */
+static void
+freeze_init(void)
+{
+	int scr = DefaultScreen(x11.dpy);
+	Visual *vis = DefaultVisual(x11.dpy, scr);
+	uint depth = (uint)DefaultDepth(x11.dpy, scr);
+
+	freeze.im = shm_image_create(&freeze.info, vis, depth, x11.root.w, x11.root.h);
+	if (freeze.im != NULL) {
+		if (!XShmGetImage(x11.dpy, x11.root.win, freeze.im, 0, 0, AllPlanes))
+			fatal("failed to get image");
+		XShmDetach(x11.dpy, &freeze.info);
+		freeze.shm = True;
+	} else { /* the reply gets copied into a client side buffer instead */
+		freeze.im = XGetImage(
+			x11.dpy, x11.root.win, 0, 0, x11.root.w, x11.root.h,
+			AllPlanes, ZPixmap
+		);
+		if (freeze.im == NULL)
+			fatal("failed to get image");
+	}
+	ximg_conv(freeze.im); /* bail out early on an odd format */
+}
+
+/* point `view` at the area `img` describes, within the snapshot */
+static void
+freeze_view(Image *img, XImage *view)
+{
+	*view = *freeze.im;
+	view->width = (int)img->w;
+	view->height = (int)img->h;
+	view->data = (char *)ximg_at(freeze.im, img->x, img->y);
+	img->im = view;
+}
+
+/* without XDamage, redrawing every MAX_FRAME_TIME is the only way to keep up
+ * with the screen. a frozen one doesn't change. */
+static Bool
+redraw_periodic(void)
+{
+	return !x11.valid.damage && freeze.im == NULL;
+}
+
+/*
+ * returns the capture around x,y. if the one in flight is for somewhere
+ * else (or a different zoom) it's thrown away, so at most one request is
+ * ever outstanding and a frame never shows an outdated position.
+ */
+static const Image *
+capture_get(int x, int y, Bool window)
+{
+	Capture *cap;
+	Image img;
+	Bool fits = capture_geometry(&img, x, y);
+
+	if (freeze.im != NULL) {
+		freeze.img = img;
+		freeze_view(&freeze.img, &freeze.view);
+		return &freeze.img;
+	}
+	if (!fits) /* drops the one in flight, see capture_init() */
+		capture_reserve(capture_max(MAG_FACTOR_MIN));
+	cap = x11.cap.inflight;
+	if (cache.on && !window)
+		return cache_get(&img, x, y);
+	if (cap != NULL && (cap->window != window ||
+	    cap->img.x != img.x || cap->img.y != img.y ||
+	    cap->img.w != img.w || cap->img.h != img.h ||
+	    cap->img.cx != img.cx || cap->img.cy != img.cy ||
+	    cap->img.wanted.w != img.wanted.w))
+	{
+		xcb_discard_reply(x11.cap.c, cap->seq);
+		cap->busy = False;
+		cap = x11.cap.inflight = NULL;
+	}
+	if (cap == NULL)
+		cap = capture_request(&img, window);
+	capture_wait(cap);
+	return &cap->img;
+}
+
+/*
+ * if the pointer has moved on already, get the next frame's capture going
+ * while this one is being scaled and uploaded. the latest motion event is
+ * put back for the event loop to pick up, which will then find its capture
+ * in flight.
+ */
+static void
+capture_prefetch(Bool window)
+{
+	XEvent ev, next;
+	Bool moved = False, other = False;
+
+	ASSERT(x11.cap.inflight == NULL);
+	if (freeze.im != NULL)
+		return;
+	if (cache.on && !window) /* small movements don't need a request at all */
+		return;
+	if (x11.thr.on) { /* the input comes through the mailbox instead */
+		if (thr_input()) {
+			const InputState *in = x11.thr.input + x11.thr.in.front;
+			Image img;
+			/* growing would pull the buffers from under this frame */
+			if (capture_geometry(&img, in->x, in->y))
+				capture_request(&img, window);
+			x11.thr.fresh = True;
+		}
+		return;
+	}
+	/* only from the front, a click has to be handled where it happened */
+	while (XPending(x11.dpy) > 0) {
+		XPeekEvent(x11.dpy, &next);
+		if (next.type != MotionNotify) {
+			other = True;
+			break;
+		}
+		XNextEvent(x11.dpy, &ev);
+		stats.coalesced += moved;
+		moved = True;
+	}
+	if (moved) {
+		Image img;
+		/* whatever comes next may change the zoom or end it all */
+		if (!other && capture_geometry(&img, ev.xmotion.x_root, ev.xmotion.y_root))
+			capture_request(&img, window);
+		XPutBackEvent(x11.dpy, &ev);
+	}
+}
+
+/*
+ * --sample: report the mean (or the median) of the n x n box around the
+ * pointer rather than the single pixel under it, which says little about
+ * dithered, anti-aliased or noisy content. The capture always covers the
+ * box, and the mean is summed straight off of it: zoomed out, the capture is
+ * far bigger than the box, and a table over all of it would cost more than
+ * it saves. --batch, with many boxes in the same capture, builds one. Being
+ * part of the frame, the loupe shows it live without capturing anything extra.
+ */
+
+/* (w+1) x (h+1) running sums of the 3 channels, the first row/column are 0 */
+static const uint *
+sample_table(const Image *img)
+{
+	const XImage *im = img->im;
+	const size_t sw = (size_t)(img->w + 1) * 3;
+	uint *sat = buf_get(&sample.sat, sw * (img->h + 1) * sizeof *sat);
+	XcursorPixel *row = buf_get(&sample.row, (img->w + 1) * sizeof *row);
+	const PixelConv conv = ximg_conv(im);
+	uint x, y;
+
+	memset(sat, 0, sw * sizeof *sat);
+	for (y = 0; y < img->h; ++y) {
+		const uint *up = sat + y * sw;
+		uint *s = sat + (y + 1) * sw;
+		uint r = 0, g = 0, b = 0;
+
+		conv(row, ximg_at(im, 0, y), img->w);
+		s[0] = s[1] = s[2] = 0;
+		for (x = 0; x < img->w; ++x) {
+			r += (uint)R(row[x]);
+			g += (uint)G(row[x]);
+			b += (uint)B(row[x]);
+			s[x*3 + 3] = up[x*3 + 3] + r;
+			s[x*3 + 4] = up[x*3 + 4] + g;
+			s[x*3 + 5] = up[x*3 + 5] + b;
+		}
+	}
+	return sat;
+}
+
+/* of the [x0, x1) x [y0, y1) box, from the table of a w pixels wide image */
+static ulong
+sample_mean(const uint *sat, uint w, uint x0, uint y0, uint x1, uint y1)
+{
+	const size_t sw = (size_t)(w + 1) * 3;
+	const uint *a = sat + y0 * sw, *b = sat + y1 * sw;
+	const ulong area = (ulong)(x1 - x0) * (y1 - y0);
+	ulong ret = 0;
+	uint k;
+
+	for (k = 0; k < 3; ++k) {
+		/* wraps around in between, but the result fits */
+		uint sum = b[x1*3 + k] - a[x1*3 + k] - b[x0*3 + k] + a[x0*3 + k];
+		ret = ret << 8 | ((ulong)sum + area / 2) / area;
+	}
+	return ret;
+}
+
+/* per channel, from a histogram of the box */
+/* mean of the [x0, x1) x [y0, y1) box, SAMPLE_MAX^2 * 255 fits in a uint */
+static ulong
+sample_box(const Image *img, uint x0, uint y0, uint x1, uint y1)
+{
+	const XImage *im = img->im;
+	const ulong area = (ulong)(x1 - x0) * (y1 - y0);
+	XcursorPixel *row = buf_get(&sample.row, (img->w + 1) * sizeof *row);
+	const PixelConv conv = ximg_conv(im);
+	uint x, y, r = 0, g = 0, b = 0;
+
+	for (y = y0; y < y1; ++y) {
+		conv(row, ximg_at(im, x0, y), x1 - x0);
+		for (x = 0; x < x1 - x0; ++x) {
+			r += (uint)R(row[x]);
+			g += (uint)G(row[x]);
+			b += (uint)B(row[x]);
+		}
+	}
+	return ((ulong)r + area / 2) / area << 16 |
+	       ((ulong)g + area / 2) / area << 8 |
+	       ((ulong)b + area / 2) / area;
+}
+
+static ulong
+sample_median(const Image *img, uint x0, uint y0, uint x1, uint y1)
+{
+	const XImage *im = img->im;
+	const ulong half = ((ulong)(x1 - x0) * (y1 - y0) + 1) / 2;
+	XcursorPixel *row = buf_get(&sample.row, (img->w + 1) * sizeof *row);
+	const PixelConv conv = ximg_conv(im);
+	ulong hist[3][256], ret = 0;
+	uint x, y, k;
+
+	memset(hist, 0, sizeof hist);
+	for (y = y0; y < y1; ++y) {
+		conv(row, ximg_at(im, x0, y), x1 - x0);
+		for (x = 0; x < x1 - x0; ++x) {
+			++hist[0][R(row[x])];
+			++hist[1][G(row[x])];
+			++hist[2][B(row[x])];
+		}
+	}
+	for (k = 0; k < 3; ++k) {
+		ulong acc = hist[k][0];
+		uint v = 0;
+		while (acc < half)
+			acc += hist[k][++v];
+		ret = ret << 8 | v;
+	}
+	return ret;
+}
+
+/* sets sample.color for the n x n box around the pointer in `img` */
+static void
+sample_update(const Image *img, uint n)
+{
+	const int lx = img->cx - (int)(n / 2), ly = img->cy - (int)(n / 2);
+	uint x0, y0, x1, y1;
+
+	sample.valid = n > 1;
+	if (!sample.valid)
+		return;
+	x0 = (uint)CLAMP(lx, 0, (int)img->w);
+	y0 = (uint)CLAMP(ly, 0, (int)img->h);
+	x1 = (uint)CLAMP(lx + (int)n, 0, (int)img->w);
+	y1 = (uint)CLAMP(ly + (int)n, 0, (int)img->h);
+	ASSERT(x0 < x1 && y0 < y1); /* the pointer is always inside */
+	sample.color = sample.median ?
+		sample_median(img, x0, y0, x1, y1) :
+		sample_box(img, x0, y0, x1, y1);
+}
+
+static void
+sample_plot(XcursorImage *img, int x, int y, XcursorPixel col)
+{
+	XcursorPixel *p = img->pixels + (size_t)y * img->width + (size_t)x;
+	if (*p >> 24) /* leave what circle() made transparent alone */
+		*p = col;
+}
+
+/* outline the box in the loupe, with a swatch of its color below the center */
+static void
+sample_draw(XcursorImage *img, uint n, float factor)
+{
+	const int m = (int)img->width / 2, end = (int)img->width - 1;
+	const int lo = m - (int)((float)(n / 2) * factor);
+	const int hi = m + (int)((float)(n - n / 2) * factor) - 1;
+	const int s = (int)SAMPLE_SWATCH_SIZE, sx = m - s / 2, sy = m + m / 2 - s / 2;
+	int i, k;
+
+	for (i = MAX(lo, 0); i <= MIN(hi, end); ++i) {
+		if (lo >= 0) {
+			sample_plot(img, i, lo, SAMPLE_BOX_COLOR);
+			sample_plot(img, lo, i, SAMPLE_BOX_COLOR);
+		}
+		if (hi <= end) {
+			sample_plot(img, i, hi, SAMPLE_BOX_COLOR);
+			sample_plot(img, hi, i, SAMPLE_BOX_COLOR);
+		}
+	}
+	for (i = 0; i < s; ++i) {
+		for (k = 0; k < s; ++k) {
+			Bool border = i == 0 || k == 0 || i == s - 1 || k == s - 1;
+			sample_plot(
+				img, sx + k, sy + i,
+				border ? SAMPLE_BOX_COLOR : (XcursorPixel)(0xff000000 | sample.color)
+			);
+		}
+	}
+}
+
+/* ctrl+scroll, in steps of ~6% that keep an odd box odd */
+static uint
+sample_resize(uint n, int dir)
+{
+	const uint step = 2 * MAX(1, n / 32);
+
+	if (dir > 0)
+		return MIN(SAMPLE_MAX, n + step);
+	return n > step ? n - step : 1;
+}
+
+static ulong
+get_pixel(int x, int y)
+{
+	ulong ret;
+
+	if (cursor_img != NULL) {
+		const XcursorImage *img = cursor_img;
+		uint m;
+
+		if (x11.thr.on) { /* what's on screen, not whatever the render thread is drawing */
+			const FrameBuf *f = x11.thr.frame + x11.thr.out.front;
+			if (f->sampled)
+				return f->color;
+			img = f->img;
+		} else if (sample.valid) {
+			return sample.color;
+		}
+		m = img->height / 2;
+		ret = img->pixels[m * img->width + m];
+		ret &= 0x00ffffff; /* cut off the alpha */
+	} else {
+		Image img;
+		XImage view;
+
+		image_geometry(&img, x, y, sample.n);
+		if (freeze.im != NULL) {
+			freeze_view(&img, &view);
+		} else {
+			img.im = XGetImage(
+				x11.input, x11.root.win, (int)img.x, (int)img.y, img.w, img.h,
+				AllPlanes, ZPixmap
+			);
+			if (img.im == NULL)
+				fatal("failed to get image");
+		}
+		if (sample.n > 1) {
+			sample_update(&img, sample.n);
+			ret = sample.color;
+		} else {
+			ret = ximg_pixel_get(img.im, img.cx, img.cy);
+		}
+		if (img.im != &view)
+			XDestroyImage(img.im);
+	}
+
+	return ret;
+}
+
+static char *
+fmt_uint(char *p, ulong v)
+{
+	char tmp[24];
+	int n = 0;
+
+	do {
+		tmp[n++] = (char)('0' + v % 10);
+	} while ((v /= 10) > 0);
+	while (n > 0)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char *
+fmt_str(char *p, const char *s)
+{
+	while (*s != '\0')
+		*p++ = *s++;
+	return p;
+}
+
+/* `v` with `prec` (at most 4) decimal places */
+static char *
+fmt_fixed(char *p, float v, int prec)
+{
+	static const ulong scale[] = { 1, 10, 100, 1000, 10000 };
+	const ulong q = (ulong)((v < 0.0f ? -v : v) * (float)scale[prec] + 0.5f);
+	ulong frac = q % scale[prec];
+	int i;
+
+	if (v < 0.0f && q != 0)
+		*p++ = '-';
+	p = fmt_uint(p, q / scale[prec]);
+	if (prec > 0) {
+		*p++ = '.';
+		for (i = prec; i > 0; --i, frac /= 10)
+			p[i - 1] = (char)('0' + frac % 10);
+		p += prec;
+	}
+	return p;
+}
+
+/*
+ * a line of output for `pix`, returns its length. `val` is its color_convert()
+ * output. at most COLOR_FMT_MAX bytes are written. hand rolled since --batch
+ * formats millions of these.
+ */
+#define COLOR_FMT_MAX 256
+static size_t
+color_format(char *dst, ulong pix, const float *val, enum output fmt)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *p = dst;
+	uint k;
+	int i;
+
+	if (fmt & OUTPUT_HEX) {
+		p = fmt_str(p, "hex:\t#");
+		for (i = 20; i >= 0; i -= 4)
+			*p++ = hex[(pix >> i) & 0xF];
+		*p++ = '\t';
+	}
+	if (fmt & OUTPUT_RGB) {
+		p = fmt_str(p, "rgb:\t");
+		p = fmt_uint(p, R(pix)); *p++ = ' ';
+		p = fmt_uint(p, G(pix)); *p++ = ' ';
+		p = fmt_uint(p, B(pix)); *p++ = '\t';
+	}
+	for (k = 0; k < ARRLEN(COLOR_SPACE); ++k) {
+		if (!(fmt & COLOR_SPACE[k].fmt))
+			continue;
+		p = fmt_str(p, COLOR_SPACE[k].label);
+		*p++ = ':';
+		*p++ = '\t';
+		for (i = 0; i < 3; ++i) {
+			p = fmt_fixed(p, *val++, COLOR_SPACE[k].prec);
+			*p++ = i < 2 ? ' ' : '\t';
+		}
+	}
+	*p++ = '\n';
+	ASSERT(p - dst <= COLOR_FMT_MAX);
+	return (size_t)(p - dst);
+}
+
+/* color_format() for a single pixel */
+static size_t
+color_line(char *dst, ulong pix, enum output fmt)
+{
+	float val[3 * ARRLEN(COLOR_SPACE)];
+
+	color_convert(val, &pix, 1, fmt);
+	return color_format(dst, pix, val, fmt);
+}
+
+/* a --client going away ends its session, rather than the daemon */
+static void
+out_flush(void)
+{
+	fflush(stdout);
+	if (!ferror(stdout))
+		return;
+	if (!srv.on)
+		fatal("writing to stdout failed");
+	clearerr(stdout);
+	srv.gone = True;
+}
+
+static void
+print_color(int x, int y, enum output fmt)
+{
+	char buf[COLOR_FMT_MAX];
+
+	if (fmt == OUTPUT_NONE)
+		return;
+
+	fwrite(buf, 1, color_line(buf, get_pixel(x, y), fmt), stdout);
+	out_flush();
+}
+
+/*
+ * --batch: colors for a stream of `x y` points or `x y w h` rectangles on
+ * stdin, one per line, without grabbing anything. Rectangles, and points
+ * with --sample, report the mean (or median) of the area.
+ * The bounding box of the input gets captured in bands of at most
+ * BATCH_TILE_MAX pixels, the next band's capture going out while the
+ * current one is worked through, and each band gets a summed-area table so
+ * that any number of rectangles cost the same. With --freeze, the bands are
+ * views into the snapshot instead.
+ */
+static BatchEntry *
+batch_read(size_t *n)
+{
+	BatchEntry *e = NULL;
+	char *in = NULL, *p, *end;
+	size_t len = 0, cap = 0, ecap = 0;
+	ulong line;
+
+	for (;;) {
+		size_t got;
+		if (len == cap) {
+			cap = cap ? cap * 2 : 1 << 16;
+			if ((in = realloc(in, cap)) == NULL)
+				fatal("out of memory");
+		}
+		if ((got = fread(in + len, 1, cap - len, stdin)) == 0)
+			break;
+		len += got;
+	}
+	if (ferror(stdin))
+		fatal("--batch: failed to read stdin");
+
+	*n = 0;
+	for (p = in, end = in + len, line = 1; p < end; ++p, ++line) {
+		ulong v[4];
+		int k = 0;
+
+		while (p < end && *p != '\n') {
+			if (*p == ' ' || *p == '\t' || *p == '\r') {
+				++p;
+				continue;
+			}
+			if (*p < '0' || *p > '9' || k == 4)
+				fatal("--batch: line %lu: expected `x y` or `x y w h`", line);
+			for (v[k] = 0; p < end && *p >= '0' && *p <= '9'; ++p) {
+				if (v[k] <= 0xFFFF) /* too big either way */
+					v[k] = v[k] * 10 + (ulong)(*p - '0');
+			}
+			++k;
+		}
+		if (k == 0)
+			continue;
+		if (k != 2 && k != 4)
+			fatal("--batch: line %lu: expected `x y` or `x y w h`", line);
+		if (v[0] >= x11.root.w || v[1] >= x11.root.h)
+			fatal("--batch: line %lu: outside of the screen", line);
+
+		if (*n == ecap) {
+			ecap = ecap ? ecap * 2 : 1024;
+			if ((e = realloc(e, ecap * sizeof *e)) == NULL)
+				fatal("out of memory");
+		}
+		if (k == 2) {
+			Image img;
+			image_geometry(&img, (int)v[0], (int)v[1], sample.n);
+			e[*n].r.x = (short)img.x;
+			e[*n].r.y = (short)img.y;
+			e[*n].r.width = (ushort)img.w;
+			e[*n].r.height = (ushort)img.h;
+		} else {
+			if (v[2] == 0 || v[3] == 0 ||
+			    v[0] + v[2] > x11.root.w || v[1] + v[3] > x11.root.h)
+			{
+				fatal("--batch: line %lu: outside of the screen", line);
+			}
+			if (v[2] * v[3] > UINT_MAX / 255) /* see sample_table() */
+				fatal("--batch: line %lu: rectangle too big", line);
+			e[*n].r.x = (short)v[0];
+			e[*n].r.y = (short)v[1];
+			e[*n].r.width = (ushort)v[2];
+			e[*n].r.height = (ushort)v[3];
+		}
+		++*n;
+	}
+	free(in);
+	return e;
+}
+
+/* colors for the entries `idx[n]`, which all lie within `img` */
+static void
+batch_band(BatchEntry *e, const size_t *idx, size_t n, const Image *img)
+{
+	const PixelConv conv = ximg_conv(img->im);
+	const uint *sat = NULL;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		BatchEntry *b = e + idx[i];
+		uint x0 = (uint)b->r.x - img->x, y0 = (uint)b->r.y - img->y;
+		uint x1 = x0 + b->r.width, y1 = y0 + b->r.height;
+
+		if (b->r.width == 1 && b->r.height == 1) {
+			XcursorPixel p;
+			conv(&p, ximg_at(img->im, x0, y0), 1);
+			b->color = p & 0xFFFFFF;
+		} else if (sample.median) {
+			b->color = sample_median(img, x0, y0, x1, y1);
+		} else {
+			if (sat == NULL) /* only paid for once per band */
+				sat = sample_table(img);
+			b->color = sample_mean(sat, img->w, x0, y0, x1, y1);
+		}
+	}
+}
+
+static void
+batch_run(enum output fmt)
+{
+	BatchEntry *e;
+	size_t *idx, *start, n, i, nband;
+	XRectangle bb, *band;
+	uint bh, maxw = 0, maxh = 0;
+	char *out;
+	size_t olen = 0;
+	const size_t ocap = 1 << 20;
+	static ulong px[1024];
+	static float val[ARRLEN(px) * 3 * ARRLEN(COLOR_SPACE)];
+
+	e = batch_read(&n);
+	if (n == 0 || fmt == OUTPUT_NONE) {
+		free(e);
+		return;
+	}
+
+	{ /* bounding box, and from that the bands */
+		int x0 = e[0].r.x, y0 = e[0].r.y, x1 = x0, y1 = y0;
+		for (i = 0; i < n; ++i) {
+			x0 = MIN(x0, e[i].r.x);
+			y0 = MIN(y0, e[i].r.y);
+			x1 = MAX(x1, e[i].r.x + e[i].r.width);
+			y1 = MAX(y1, e[i].r.y + e[i].r.height);
+		}
+		bb.x = (short)x0;
+		bb.y = (short)y0;
+		bb.width = (ushort)(x1 - x0);
+		bb.height = (ushort)(y1 - y0);
+		bh = MAX(1, BATCH_TILE_MAX / bb.width);
+		nband = (bb.height + bh - 1) / bh;
+	}
+
+	/* counting sort of the entries by the band their top edge is in */
+	idx = malloc(n * sizeof *idx);
+	start = calloc(nband + 1, sizeof *start);
+	band = malloc(nband * sizeof *band);
+	if (idx == NULL || start == NULL || band == NULL)
+		fatal("out of memory");
+	for (i = 0; i < n; ++i)
+		++start[(size_t)(e[i].r.y - bb.y) / bh + 1];
+	for (i = 0; i < nband; ++i)
+		start[i + 1] += start[i];
+	for (i = 0; i < n; ++i)
+		idx[start[(size_t)(e[i].r.y - bb.y) / bh]++] = i;
+	for (i = nband; i > 0; --i) /* shifted along by the above, undo that */
+		start[i] = start[i - 1];
+	start[0] = 0;
+
+	/* each band's capture covers its entries fully, the tall ones too */
+	for (i = 0; i < nband; ++i) {
+		size_t k;
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+		for (k = start[i]; k < start[i + 1]; ++k) {
+			const XRectangle *r = &e[idx[k]].r;
+			x0 = MIN(x0, r->x);
+			y0 = MIN(y0, r->y);
+			x1 = MAX(x1, r->x + r->width);
+			y1 = MAX(y1, r->y + r->height);
+		}
+		if (x0 > x1) { /* nothing in this one */
+			x0 = x1 = bb.x;
+			y0 = y1 = bb.y;
+		}
+		band[i].x = (short)x0;
+		band[i].y = (short)y0;
+		band[i].width = (ushort)(x1 - x0);
+		band[i].height = (ushort)(y1 - y0);
+		maxw = MAX(maxw, band[i].width);
+		maxh = MAX(maxh, band[i].height);
+	}
+
+	if (freeze.im == NULL)
+		capture_init(maxw, maxh);
+	{
+		Capture *next = NULL;
+		size_t k;
+
+		for (i = 0; i < nband; ++i) {
+			Image img = {0};
+			XImage view;
+			Capture *cap;
+
+			if (band[i].width == 0)
+				continue;
+			cap = next;
+			next = NULL;
+			img.x = (uint)band[i].x;
+			img.y = (uint)band[i].y;
+			img.w = band[i].width;
+			img.h = band[i].height;
+			if (freeze.im != NULL) {
+				freeze_view(&img, &view);
+				batch_band(e, idx + start[i], start[i + 1] - start[i], &img);
+				continue;
+			}
+			if (cap == NULL)
+				cap = capture_request(&img, False);
+			for (k = i + 1; k < nband && band[k].width == 0; ++k) {}
+			if (k < nband) {
+				Image ni = {0};
+				ni.x = (uint)band[k].x;
+				ni.y = (uint)band[k].y;
+				ni.w = band[k].width;
+				ni.h = band[k].height;
+				next = capture_request(&ni, False);
+			}
+			capture_wait(cap);
+			batch_band(e, idx + start[i], start[i + 1] - start[i], &cap->img);
+		}
+	}
+
+	/* converted a chunk at a time, then formatted */
+	if ((out = malloc(ocap)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < n; i += ARRLEN(px)) {
+		const size_t len = MIN(n - i, ARRLEN(px));
+		size_t k, stride;
+
+		for (k = 0; k < len; ++k)
+			px[k] = e[i + k].color;
+		stride = color_convert(val, px, len, fmt);
+		for (k = 0; k < len; ++k) {
+			if (ocap - olen < COLOR_FMT_MAX) {
+				fwrite(out, 1, olen, stdout);
+				olen = 0;
+			}
+			olen += color_format(out + olen, px[k], val + k * stride, fmt);
+		}
+	}
+	fwrite(out, 1, olen, stdout);
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("writing to stdout failed");
+
+	free(out);
+	free(band);
+	free(start);
+	free(idx);
+	free(e);
+}
+
+/*
+ * --watch: print the color under the pointer whenever it or the position
+ * changes, without grabbing anything. The pointer is polled at `hz`, and
+ * the capture is skipped unless it moved or XDamage reported the area as
+ * changed, so sitting idle costs a QueryPointer round trip per tick.
+ */
+ATTR_NORETURN
+static void
+watch_run(uint hz, enum output fmt)
+{
+	const ulong period = 1000 / hz;
+	ulong next = mono_ms(), col = 0;
+	int x = -1, y = -1;
+	Bool dirty = True, damaged = False;
+
+	if (freeze.im == NULL)
+		damage_init();
+	for (;;) {
+		char buf[COLOR_FMT_MAX + 32], *p = buf;
+		Window root, child;
+		int rx, ry, wx, wy;
+		uint mask;
+		ulong now;
+
+		/* sleep until the next tick, keeping track of damage meanwhile */
+		while ((now = mono_ms()) < next || XPending(x11.dpy) > 0) {
+			struct pollfd pfd;
+			XEvent ev;
+
+			if (XPending(x11.dpy) > 0) {
+				XNextEvent(x11.dpy, &ev);
+				if (x11.valid.damage && ev.type == x11.damage.ev_base + XDamageNotify) {
+					const XDamageNotifyEvent *de = (const XDamageNotifyEvent *)(const void *)&ev;
+					dirty |= rect_overlap(&de->area, &x11.damage.area);
+					damaged = True;
+				}
+				continue;
+			}
+			pfd.fd = ConnectionNumber(x11.dpy);
+			pfd.events = POLLIN;
+			poll(&pfd, 1, (int)(next - now));
+			if (sig_recieved)
+				exit(128 + sig_recieved);
+		}
+		/* after a stall, carry on from now rather than catching up */
+		next = MAX(next + period, now);
+		if (damaged) /* once per tick, the bounding box grows meanwhile */
+			XDamageSubtract(x11.dpy, x11.damage.d, None, None);
+		damaged = False;
+
+		if (!XQueryPointer(x11.dpy, x11.root.win, &root, &child, &rx, &ry, &wx, &wy, &mask))
+			continue; /* on another screen */
+		if (rx == x && ry == y && !dirty && x11.valid.damage)
+			continue;
+		{
+			Image img;
+			ulong c = get_pixel(rx, ry) & 0xFFFFFF;
+
+			image_geometry(&img, rx, ry, sample.n);
+			x11.damage.area.x = (short)img.x;
+			x11.damage.area.y = (short)img.y;
+			x11.damage.area.width = (ushort)img.w;
+			x11.damage.area.height = (ushort)img.h;
+			dirty = False;
+			if (rx == x && ry == y && c == col)
+				continue;
+			x = rx;
+			y = ry;
+			col = c;
+		}
+		p = fmt_str(p, "pos:\t");
+		p = fmt_uint(p, (ulong)x); *p++ = ' ';
+		p = fmt_uint(p, (ulong)y); *p++ = '\t';
+		p += color_line(p, col, fmt);
+		fwrite(buf, 1, (size_t)(p - buf), stdout);
+		fflush(stdout);
+		if (ferror(stdout))
+			fatal("writing to stdout failed");
+	}
+}
+
+static uint
+watch_parse(Str arg)
+{
+	ulong hz = 0;
+	ptrdiff_t i;
+
+	for (i = 0; i < arg.len && hz <= 1000; ++i) {
+		if (arg.s[i] < '0' || arg.s[i] > '9')
+			fatal("--watch: invalid rate `%.*s`", (int)arg.len, arg.s);
+		hz = hz * 10 + (ulong)(arg.s[i] - '0');
+	}
+	if (arg.len == 0 || hz < 1 || hz > 1000)
+		fatal("--watch: rate must be between 1 and 1000 Hz");
+	return (uint)hz;
+}
+
+/*
+ * --palette: the dominant colors of a dragged out rectangle. Pixels go into
+ * a 15bit histogram, which makes for a perfect hash that fits in cache,
+ * with the exact channel values summed up on the side. Runs of the same
+ * pixel, which UIs and charts are mostly made of, are added at once.
+ * Median cut then splits the buckets into up to `n` boxes, which are
+ * reported by their mean color, most common first.
+ */
+static void
+palette_add(PalBucket *h, XcursorPixel c, ulong n)
+{
+	PalBucket *b = h + ((c >> 9 & 0x7C00) | (c >> 6 & 0x3E0) | (c >> 3 & 0x1F));
+
+	b->n += n;
+	b->r += R(c) * n;
+	b->g += G(c) * n;
+	b->b += B(c) * n;
+}
+
+static void
+palette_hist(PalBucket *h, const Image *img)
+{
+	static Buf row_buf;
+	const XImage *im = img->im;
+	const PixelConv conv = ximg_conv(im);
+	XcursorPixel *row = buf_get(&row_buf, img->w * sizeof *row);
+	uint x, y;
+
+	for (y = 0; y < img->h; ++y) {
+		XcursorPixel run;
+		ulong len = 1;
+
+		conv(row, ximg_at(im, 0, y), img->w);
+		for (run = row[0], x = 1; x < img->w; ++x) {
+			if (row[x] == run) {
+				++len;
+			} else {
+				palette_add(h, run, len);
+				run = row[x];
+				len = 1;
+			}
+		}
+		palette_add(h, run, len);
+	}
+}
+
+static int
+palette_cmp_box(const void *a, const void *b)
+{
+	const ulong x = ((const PalBox *)a)->n, y = ((const PalBox *)b)->n;
+	return (x < y) - (x > y);
+}
+
+/*
+ * splits `box` at the weighted median of its widest channel into itself and
+ * `out`. the buckets being 5 bits per channel, the median comes from a 32
+ * entry histogram and the split is a partition rather than a sort.
+ */
+static Bool
+palette_split(const PalBucket *h, ushort *ent, PalBox *box, PalBox *out)
+{
+	ulong hist[32] = {0}, acc = 0;
+	uint lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 }, i, j, k, c, sh, m;
+
+	if (box->hi - box->lo < 2)
+		return False;
+	for (i = box->lo; i < box->hi; ++i) {
+		for (c = 0; c < 3; ++c) {
+			uint v = ent[i] >> (c * 5) & 0x1F;
+			lo[c] = MIN(lo[c], v);
+			hi[c] = MAX(hi[c], v);
+		}
+	}
+	for (k = 0, c = 1; c < 3; ++c) {
+		if (hi[c] - lo[c] > hi[k] - lo[k])
+			k = c;
+	}
+	sh = k * 5;
+	for (i = box->lo; i < box->hi; ++i)
+		hist[ent[i] >> sh & 0x1F] += h[ent[i]].n;
+	for (m = lo[k]; m < hi[k] - 1 && acc + hist[m] < box->n / 2; ++m)
+		acc += hist[m];
+	/* the buckets are distinct, so hi[k] > lo[k] and neither side is empty */
+	for (acc = 0, i = j = box->lo; i < box->hi; ++i) {
+		if ((uint)(ent[i] >> sh & 0x1F) <= m) {
+			ushort tmp = ent[j];
+			ent[j] = ent[i];
+			ent[i] = tmp;
+			acc += h[ent[j++]].n;
+		}
+	}
+	out->lo = j;
+	out->hi = box->hi;
+	out->n = box->n - acc;
+	box->hi = j;
+	box->n = acc;
+	return True;
+}
+
+/* up to `n` boxes into `box`, returns how many */
+static uint
+palette_cut(const PalBucket *h, ushort *ent, uint nent, PalBox *box, uint n)
+{
+	uint nbox = 1, i;
+
+	box[0].lo = 0;
+	box[0].hi = nent;
+	for (box[0].n = 0, i = 0; i < nent; ++i)
+		box[0].n += h[ent[i]].n;
+	while (nbox < n) {
+		uint best = nbox;
+		for (i = 0; i < nbox; ++i) { /* the most populated, that can still be split */
+			if (box[i].hi - box[i].lo >= 2 && (best == nbox || box[i].n > box[best].n))
+				best = i;
+		}
+		if (best == nbox || !palette_split(h, ent, box + best, box + nbox))
+			break;
+		++nbox;
+	}
+	return nbox;
+}
+
+static void
+palette_print(const PalBucket *h, const ushort *ent, PalBox *box, uint nbox, enum output fmt)
+{
+	ulong px[256];
+	float val[ARRLEN(px) * 3 * ARRLEN(COLOR_SPACE)];
+	size_t stride;
+	uint i, k;
+
+	ASSERT(nbox <= ARRLEN(px));
+	qsort(box, nbox, sizeof *box, palette_cmp_box);
+	for (i = 0; i < nbox; ++i) {
+		ulong r = 0, g = 0, b = 0, n = box[i].n;
+		for (k = box[i].lo; k < box[i].hi; ++k) {
+			r += h[ent[k]].r;
+			g += h[ent[k]].g;
+			b += h[ent[k]].b;
+		}
+		px[i] = (r + n/2) / n << 16 | (g + n/2) / n << 8 | (b + n/2) / n;
+	}
+	stride = color_convert(val, px, nbox, fmt);
+	for (i = 0; i < nbox; ++i) {
+		char buf[COLOR_FMT_MAX + 32], *p = buf;
+		p = fmt_str(p, "count:\t");
+		p = fmt_uint(p, box[i].n);
+		*p++ = '\t';
+		p += color_format(p, px[i], val + i * stride, fmt);
+		fwrite(buf, 1, (size_t)(p - buf), stdout);
+	}
+	fwrite("\n", 1, 1, stdout);
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("writing to stdout failed");
+}
+
+static void
+palette_image(const Image *img, uint n, enum output fmt)
+{
+	PalBucket *h = calloc(1 << 15, sizeof *h);
+	ushort *ent = malloc((1 << 15) * sizeof *ent);
+	PalBox box[256];
+	uint i, nent = 0;
+
+	if (h == NULL || ent == NULL)
+		fatal("out of memory");
+	palette_hist(h, img);
+	for (i = 0; i < 1 << 15; ++i) {
+		if (h[i].n > 0)
+			ent[nent++] = (ushort)i;
+	}
+	palette_print(h, ent, box, palette_cut(h, ent, nent, box, n), fmt);
+	free(ent);
+	free(h);
+}
+
+/*
+ * captures `r` and prints its palette. the shared segment is only used
+ * without --threaded, MIT-SHM setup being on the render thread's connection.
+ */
+static void
+palette_run(const XRectangle *r, uint n, enum output fmt)
+{
+	const int scr = DefaultScreen(x11.input);
+	Image img = {0};
+	XImage view;
+	XShmSegmentInfo info;
+	Bool shm = False;
+
+	img.x = (uint)r->x;
+	img.y = (uint)r->y;
+	img.w = r->width;
+	img.h = r->height;
+	if (freeze.im != NULL) {
+		freeze_view(&img, &view);
+		palette_image(&img, n, fmt);
+		return;
+	}
+	if (x11.mwin.win != None) /* keep the magnifier out of it */
+		XUnmapWindow(x11.input, x11.mwin.win);
+	if (!x11.thr.on) {
+		img.im = shm_image_create(
+			&info, DefaultVisual(x11.input, scr),
+			(uint)DefaultDepth(x11.input, scr), img.w, img.h
+		);
+		shm = img.im != NULL && XShmGetImage(
+			x11.dpy, x11.root.win, img.im, r->x, r->y, AllPlanes
+		);
+		if (img.im != NULL && !shm)
+			shm_image_destroy(&info, img.im);
+	}
+	if (!shm) {
+		img.im = XGetImage(
+			x11.input, x11.root.win, r->x, r->y, img.w, img.h, AllPlanes, ZPixmap
+		);
+	}
+	if (x11.mwin.win != None)
+		XMapWindow(x11.input, x11.mwin.win);
+	if (img.im == NULL)
+		fatal("failed to get image");
+	palette_image(&img, n, fmt);
+	if (shm)
+		shm_image_destroy(&info, img.im);
+	else
+		XDestroyImage(img.im);
+}
+
+/* draws, or erases, the selection rectangle */
+static void
+sel_toggle(void)
+{
+	if (sel.gc == NULL) {
+		XGCValues v;
+		const int scr = DefaultScreen(x11.input);
+		v.function = GXxor;
+		v.foreground = WhitePixel(x11.input, scr) ^ BlackPixel(x11.input, scr);
+		v.subwindow_mode = IncludeInferiors;
+		sel.gc = XCreateGC(
+			x11.input, x11.root.win, GCFunction | GCForeground | GCSubwindowMode, &v
+		);
+	}
+	XDrawRectangle(
+		x11.input, x11.root.win, sel.gc, sel.r.x, sel.r.y,
+		(uint)sel.r.width - 1, (uint)sel.r.height - 1
+	);
+	sel.drawn = !sel.drawn;
+}
+
+static void
+sel_update(int x, int y)
+{
+	if (sel.drawn)
+		sel_toggle();
+	sel.r.x = (short)MIN(sel.ax, x);
+	sel.r.y = (short)MIN(sel.ay, y);
+	sel.r.width = (ushort)(DIFF(sel.ax, x) + 1);
+	sel.r.height = (ushort)(DIFF(sel.ay, y) + 1);
+	if (sel.on)
+		sel_toggle();
+}
+
+static void
+sel_start(int x, int y)
+{
+	sel.on = True;
+	sel.ax = x;
+	sel.ay = y;
+	sel_update(x, y);
+}
+
+/* ends the selection at x,y, a plain click just picks the color */
+static void
+sel_finish(int x, int y, const Options *opt)
+{
+	sel.on = False;
+	sel_update(x, y);
+	if (sel.r.width == 1 && sel.r.height == 1)
+		print_color(x, y, opt->fmt);
+	else
+		palette_run(&sel.r, opt->palette, opt->fmt);
+}
+
+static uint
+palette_parse(Str arg)
+{
+	ulong n = 0;
+	ptrdiff_t i;
+
+	for (i = 0; i < arg.len && n <= 256; ++i) {
+		if (arg.s[i] < '0' || arg.s[i] > '9')
+			fatal("--palette: invalid size `%.*s`", (int)arg.len, arg.s);
+		n = n * 10 + (ulong)(arg.s[i] - '0');
+	}
+	if (arg.len == 0 || n < 1 || n > 256)
+		fatal("--palette: size must be between 1 and 256");
+	return (uint)n;
+}
+
+ATTR_NORETURN
+static void
+usage(void)
+{
+	char s[] =
+		"usage: "PROGNAME" [options]\n"
+		"See the manpage for more details.\n"
+	;
+	fwrite(s, 1, sizeof s - 1, stderr);
+	die();
+}
+
+ATTR_NORETURN
+static void
+version(void)
+{
+	char s[] =
+		PROGNAME" v1.1.0\n\n"
+		"Copyright (C) 2022-2024 NRK and contributors.\n"
+		"License: GPLv3+ <https://gnu.org/licenses/gpl.html>.\n"
+		"Upstream: <https://codeberg.org/NRK/sxcs>\n"
+	;
+	fwrite(s, 1, sizeof s - 1, stderr);
+	die();
+}
+
+static void
+filter_parse(Str arg)
+{
+	static FilterFunc f_buf[16];
+	static FilterSeq fs_buf = FILTER_SEQ_FROM_ARRAY(f_buf);
+
+	Str tok;
+	uint i, f_len = 0;
+
+	if (arg.len == 0)
+		fatal("--mag-filters: no argument provided");
+
+	while (str_tok(&arg, &tok, ',')) {
+		int found_match = 0;
+		for (i = 0; i < ARRLEN(FILTER_TABLE); ++i) {
+			if (str_eq(tok, FILTER_TABLE[i].str)) {
+				if (f_len >= ARRLEN(f_buf))
+					fatal("--mag-filters: too many filters");
+				f_buf[f_len++] = FILTER_TABLE[i].f;
+				found_match = 1;
+				break;
+			}
+		}
+
+		if (!found_match)
+			fatal("invalid filter `%.*s`", (int)tok.len, tok.s);
+	}
+
+	ASSERT(arg.len == 0);
+	fs_buf.len = f_len;
+	filter = &fs_buf;
+	overlay.valid = 0;
+}
+
+static void
+mag_func_parse(Str arg)
+{
+	uint i;
+
+	if (arg.len == 0)
+		fatal("--mag-func: no argument provided");
+	for (i = 0; i < ARRLEN(MAG_FUNC_TABLE); ++i) {
+		if (str_eq(arg, MAG_FUNC_TABLE[i].str)) {
+			mag_func = MAG_FUNC_TABLE[i].f;
+			return;
+		}
+	}
+	fatal("invalid scaling function `%.*s`", (int)arg.len, arg.s);
+}
+
+static void
+sample_parse(Str arg)
+{
+	ulong n[2] = { 0, 0 };
+	uint k = 0;
+	ptrdiff_t i;
+
+	if (arg.len == 0)
+		fatal("--sample: no argument provided");
+	for (i = 0; i < arg.len; ++i) {
+		if (arg.s[i] == 'x' && k == 0 && i > 0)
+			++k;
+		else if (arg.s[i] >= '0' && arg.s[i] <= '9' && n[k] <= SAMPLE_MAX)
+			n[k] = n[k] * 10 + (ulong)(arg.s[i] - '0');
+		else
+			fatal("--sample: invalid box size `%.*s`", (int)arg.len, arg.s);
+	}
+	if (k == 0)
+		n[1] = n[0];
+	if (n[0] != n[1] || n[0] < 1 || n[0] > SAMPLE_MAX)
+		fatal("--sample: box must be NxN, with N between 1 and %u", SAMPLE_MAX);
+	sample.n = (uint)n[0];
+}
+
+/* inspired by https://github.com/skeeto/scratch/blob/master/parsers/imgo.c */
+typedef struct { char **argv, *cur, *flag; int len; } OptCtx;
+#define OPT(O, SO, LO) ( ((O)->len == 1 && (SO) != 0x0 && (O)->flag[0] == (SO)) || \
+	((LO) != 0 && (O)->len-1 == sizeof(LO)-1 && memcmp(LO, (O)->flag+1, (O)->len-1) == 0) )
+static int
+opt_next(OptCtx *o)
+{
+	if (o->cur == NULL || *o->cur == '\0') {
+		if ((o->cur = *o->argv++) == NULL || *o->cur++ != '-' || *o->cur == '\0')
+			return --o->argv, 0;
+		if (*o->cur == '-') {
+			o->flag = o->cur; o->cur = NULL;
+			return o->len = (int)strlen(o->flag);
+		}
+	}
+	o->flag = o->cur++;
+	return o->len = 1;
+}
+
+static const char *
+opt_path(const char *arg, const char *name)
+{
+	if (arg == NULL || arg[0] == '\0')
+		fatal("%s: no argument provided", name);
+	return arg;
+}
+
+static Options
+opt_parse(int argc, char *argv[])
+{
+	Options ret = {0};
+	int fmt_default = 1;
+	OptCtx o[1] = {0};
+
+	for (o->argv = argv + (argc > 0); opt_next(o);) { /* NOLINTBEGIN(*misleading-indentation) */
+		     if (OPT(o, 0x0, "rgb"))  ret.fmt |= OUTPUT_RGB;
+		else if (OPT(o, 0x0, "hex"))  ret.fmt |= OUTPUT_HEX;
+		else if (OPT(o, 0x0, "hsl"))  ret.fmt |= OUTPUT_HSL;
+		else if (OPT(o, 0x0, "hsv"))  ret.fmt |= OUTPUT_HSV;
+		else if (OPT(o, 0x0, "linear"))  ret.fmt |= OUTPUT_LINEAR;
+		else if (OPT(o, 0x0, "lab"))  ret.fmt |= OUTPUT_LAB;
+		else if (OPT(o, 0x0, "oklab"))  ret.fmt |= OUTPUT_OKLAB;
+		else if (OPT(o, 0x0, "oklch"))  ret.fmt |= OUTPUT_OKLCH;
+		else if (OPT(o, 0x0, "color-none"))  ret.fmt = fmt_default = 0;
+		else if (OPT(o, 'o', "one-shot"))    ret.oneshot = 1;
+		else if (OPT(o, 'q', "quit-on-keypress"))  ret.quit_on_keypress = 1;
+		else if (OPT(o, 'k', "keyboard"))  ret.keyboard = 1;
+		else if (OPT(o, 0x0, "mag-none"))  ret.no_mag = 1;
+		else if (OPT(o, 0x0, "mag-window"))  ret.mag_window = 1;
+		else if (OPT(o, 0x0, "threaded"))  ret.threaded = 1;
+		else if (OPT(o, 0x0, "freeze"))  ret.freeze = 1;
+		else if (OPT(o, 0x0, "batch"))  ret.batch = 1;
+		else if (OPT(o, 0x0, "daemon"))  ret.daemon = 1;
+		else if (OPT(o, 0x0, "client"))  ret.client = 1;
+		else if (OPT(o, 0x0, "palette"))  ret.palette = palette_parse(str_from_cstr(*o->argv++));
+		else if (OPT(o, 0x0, "watch"))  ret.watch = WATCH_HZ;
+		else if (o->len >= 7 && memcmp(o->flag, "-watch=", 7) == 0)
+			ret.watch = watch_parse(str_from_cstr(o->flag + 7));
+		else if (OPT(o, 0x0, "mag-filters"))  filter_parse(str_from_cstr(*o->argv++));
+		else if (OPT(o, 0x0, "mag-func"))  mag_func_parse(str_from_cstr(*o->argv++));
+		else if (OPT(o, 0x0, "sample"))  sample_parse(str_from_cstr(*o->argv++));
+		else if (OPT(o, 0x0, "sample-median"))  sample.median = True;
+		else if (OPT(o, 0x0, "stats"))  stats.on = stats.print = True;
+		else if (OPT(o, 0x0, "trace"))  trace_open(*o->argv++);
+		else if (OPT(o, 0x0, "record"))  ret.record = opt_path(*o->argv++, "--record");
+		else if (OPT(o, 0x0, "replay"))  ret.replay = opt_path(*o->argv++, "--replay");
+		else if (OPT(o, 'h', "help"))     usage();
+		else if (OPT(o, 0x0, "version"))  version();
+		else fatal("unknown argument `-%.*s`", (int)o->len, o->flag);
+	} /* NOLINTEND(*misleading-indentation) */
+	if (*o->argv)
+		fatal("excess argument: `%s`", *o->argv);
+
+	if (ret.fmt == OUTPUT_NONE && fmt_default)
+		ret.fmt = OUTPUT_DEFAULT;
+
+	return ret;
+}
+
+/* the combinations that don't make sense, not ran on --daemon requests */
+static void
+opt_check(const Options *opt)
+{
+	if (opt->quit_on_keypress && opt->keyboard)
+		fatal("--quit-on-keypress and --keyboard cannot be enabled at the same time");
+	if (opt->no_mag && opt->mag_window)
+		fatal("--mag-none and --mag-window cannot be enabled at the same time");
+	if (opt->no_mag && opt->threaded)
+		fatal("--mag-none and --threaded cannot be enabled at the same time");
+	if (opt->daemon && (opt->client || opt->freeze || opt->batch || opt->watch > 0))
+		fatal("--daemon cannot be used with --client, --freeze, --batch or --watch");
+	if (opt->client && (opt->no_mag || opt->mag_window || opt->threaded || opt->freeze ||
+	                    opt->batch || opt->watch > 0 || stats.on))
+	{
+		fatal("--client: the magnifier options, --freeze, --batch, --watch and "
+		      "--stats/--trace are up to the daemon");
+	}
+	if ((opt->record != NULL || opt->replay != NULL) &&
+	    (opt->daemon || opt->client || opt->batch || opt->watch > 0))
+	{
+		fatal("--record and --replay cannot be used with --daemon, --client, --batch or --watch");
+	}
+	if (opt->record != NULL && opt->replay != NULL)
+		fatal("--record and --replay cannot be enabled at the same time");
+	if (opt->replay != NULL && opt->threaded)
+		fatal("--replay and --threaded cannot be enabled at the same time");
+}
+
+static int
+round_sym(float f)
+{
+	return f < 0 ? -ROUNDF(-f) : ROUNDF(f);
+}
+
+static float
+cubic(float x) /* Catmull-Rom, a = -0.5 */
+{
+	x = x < 0 ? -x : x;
+	if (x < 1.0f)
+		return (1.5f * x - 2.5f) * x * x + 1.0f;
+	if (x < 2.0f)
+		return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+	return 0.0f;
+}
+
+/*
+ * maps each output row/column to the first source tap, relative to the cursor
+ * position, along with `taps` weights summing up to 256. `taps == 1` means
+ * nearest neighbour and has no weights. the table only depends on the output
+ * size and the unclipped input size, so it only gets rebuilt when the zoom
+ * level changes.
+ */
+static const ScaleTab *
+scale_table(ScaleTab *t, uint out_len, uint in_len, uint taps)
+{
+	uint i, k;
+	float oc = (float)out_len / 2.0f;
+	float ic = (float)in_len / 2.0f;
+
+	ASSERT(taps == 1 || taps == 2 || taps == 4);
+	if (t->out_len == out_len && t->in_len == in_len && t->taps == taps)
+		return t;
+
+	free(t->off);
+	free(t->w);
+	t->off = malloc(out_len * sizeof *t->off);
+	t->w = malloc(out_len * taps * sizeof *t->w);
+	if (t->off == NULL || t->w == NULL)
+		fatal("out of memory");
+	for (i = 0; i < out_len; ++i) {
+		/* biased to be positive so that truncation == floor */
+		float f = ic * (((float)i - oc) / oc) + (float)in_len;
+		int fl = (int)f, *w = t->w + i * taps, sum = 0, big = 0;
+		float frac = f - (float)fl;
+
+		if (taps == 1) {
+			t->off[i] = ROUNDF(f) - (int)in_len;
+			continue;
+		}
+		t->off[i] = fl - (int)in_len - (int)(taps / 2 - 1);
+		for (k = 0; k < taps; ++k) {
+			float d = frac + (float)(taps / 2 - 1) - (float)k;
+			w[k] = round_sym((taps == 2 ? 1.0f - (d < 0 ? -d : d) : cubic(d)) * 256.0f);
+			sum += w[k];
+			big = w[k] > w[big] ? (int)k : big;
+		}
+		w[big] += 256 - sum; /* make sure rounding didn't change brightness */
+	}
+	t->out_len = out_len;
+	t->in_len = in_len;
+	t->taps = taps;
+	return t;
+}
+
+/* the tables are monotonic, find the [lo, hi) entries that land inside the input */
+static void
+scale_span(const int *off, uint len, int c, uint lim, uint *lo, uint *hi)
+{
+	for (*lo = 0; *lo < len && c + off[*lo] < 0; ++*lo) {}
+	for (*hi = len; *hi > *lo && c + off[*hi - 1] >= (int)lim; --*hi) {}
+}
+
+static void
+nearest_neighbour(XcursorImage *out, const Image *in)
+{
+	static ScaleTab tx, ty;
+	static Buf idx_buf, row_buf;
+	const int *ox = scale_table(&tx, out->width, in->wanted.w, 1)->off;
+	const int *oy = scale_table(&ty, out->height, in->wanted.h, 1)->off;
+	const uint w = out->width;
+	const PixelConv conv = ximg_conv(in->im);
+	XcursorPixel *dst = out->pixels, *row;
+	int *idx, lo = 0, prev = -1;
+	uint x, y, x0, x1, n = 0;
+
+	scale_span(ox, w, in->cx, in->w, &x0, &x1);
+	if (x0 < x1) {
+		lo = in->cx + ox[x0];
+		n = (uint)(in->cx + ox[x1 - 1] - lo) + 1;
+	}
+	/* only the [lo, lo+n) part of the source rows gets converted */
+	idx = buf_get(&idx_buf, w * sizeof *idx);
+	row = buf_get(&row_buf, (n + 1) * sizeof *row);
+	for (x = x0; x < x1; ++x)
+		idx[x] = in->cx + ox[x] - lo;
+
+	for (y = 0; y < out->height; ++y, dst += w) {
+		int iy = in->cy + oy[y];
+
+		if (iy < 0 || iy >= (int)in->h) {
+			for (x = 0; x < w; ++x)
+				dst[x] = 0xff000000;
+		} else if (iy == prev) { /* same source row, just copy it over */
+			memcpy(dst, dst - w, w * sizeof *dst);
+		} else {
+			for (x = 0; x < x0; ++x)
+				dst[x] = 0xff000000;
+			conv(row, ximg_at(in->im, (uint)lo, (uint)iy), n);
+			kern.gather(dst + x0, row, idx + x0, x1 - x0);
+			for (x = x1; x < w; ++x)
+				dst[x] = 0xff000000;
+		}
+		prev = iy;
+	}
+}
+
+/*
+ * separable filtering: a horizontal pass over every source row the vertical
+ * taps touch, into a buffer of 8bit fixed point channels, followed by the
+ * vertical pass. taps past the edge of the input are clamped to the edge,
+ * clipped out pixels are decided the same way as nearest_neighbour() does.
+ */
+static void
+interpolate(XcursorImage *out, const Image *in, uint taps)
+{
+	static ScaleTab nx, ny, tx, ty;
+	static Buf row_buf, h_buf, idx_buf, acc_buf;
+	const uint w = out->width, iw = in->w;
+	const int ih = (int)in->h;
+	const ScaleTab *wx = scale_table(&tx, w, in->wanted.w, taps);
+	const ScaleTab *wy = scale_table(&ty, out->height, in->wanted.h, taps);
+	const PixelConv conv = ximg_conv(in->im);
+	XcursorPixel *dst = out->pixels, *row;
+	uint x, y, k, i, x0, x1, y0, y1;
+	int r, r0 = 0, r1 = -1, prev = INT_MIN, *hb, *idx, *acc;
+
+	scale_span(scale_table(&nx, w, in->wanted.w, 1)->off, w, in->cx, iw, &x0, &x1);
+	scale_span(scale_table(&ny, out->height, in->wanted.h, 1)->off,
+	           out->height, in->cy, in->h, &y0, &y1);
+	if (x0 < x1 && y0 < y1) {
+		r0 = MAX(0, in->cy + wy->off[y0]);
+		r1 = MIN(ih - 1, in->cy + wy->off[y1 - 1] + (int)taps - 1);
+	}
+	row = buf_get(&row_buf, (iw + 1) * sizeof *row);
+	hb = buf_get(&h_buf, ((size_t)(r1 - r0 + 1) * w * 3 + 1) * sizeof *hb);
+	acc = buf_get(&acc_buf, w * 3 * sizeof *acc);
+	idx = buf_get(&idx_buf, w * taps * sizeof *idx);
+	for (x = x0; x < x1; ++x) {
+		for (k = 0; k < taps; ++k)
+			idx[x*taps + k] = CLAMP(in->cx + wx->off[x] + (int)k, 0, (int)iw - 1);
+	}
+
+	for (r = r0; r <= r1; ++r) {
+		int *hp = hb + (size_t)(r - r0) * w * 3;
+		conv(row, ximg_at(in->im, 0, (uint)r), iw);
+		for (x = x0; x < x1; ++x) {
+			const int *wt = wx->w + x * taps, *ix = idx + x * taps;
+			int cr = 0, cg = 0, cb = 0;
+			for (k = 0; k < taps; ++k) {
+				XcursorPixel p = row[ix[k]];
+				cr += wt[k] * (int)((p >> 16) & 0xff);
+				cg += wt[k] * (int)((p >>  8) & 0xff);
+				cb += wt[k] * (int)((p >>  0) & 0xff);
+			}
+			hp[x*3 + 0] = cr; hp[x*3 + 1] = cg; hp[x*3 + 2] = cb;
+		}
+	}
+
+	for (y = 0; y < out->height; ++y, dst += w) {
+		const int *wt = wy->w + y * taps;
+		int base = in->cy + wy->off[y];
+
+		if (y < y0 || y >= y1) {
+			for (x = 0; x < w; ++x)
+				dst[x] = 0xff000000;
+			prev = INT_MIN;
+			continue;
+		}
+		/* integer zoom levels repeat the same taps and weights */
+		if (base == prev && memcmp(wt, wt - taps, taps * sizeof *wt) == 0) {
+			memcpy(dst, dst - w, w * sizeof *dst);
+			continue;
+		}
+		prev = base;
+		memset(acc + x0*3, 0, (x1 - x0) * 3 * sizeof *acc);
+		for (k = 0; k < taps; ++k) {
+			const int *hp = hb + (size_t)(CLAMP(base + (int)k, r0, r1) - r0) * w * 3;
+			for (i = x0*3; i < x1*3; ++i)
+				acc[i] += wt[k] * hp[i];
+		}
+		for (x = 0; x < x0; ++x)
+			dst[x] = 0xff000000;
+		for (; x < x1; ++x) {
+			int c[3];
+			for (i = 0; i < 3; ++i) { /* 16bit fixed point */
+				int v = acc[x*3 + i];
+				c[i] = v < 0 ? 0 : MIN((v + (1 << 15)) >> 16, 255);
+			}
+			dst[x] = (XcursorPixel)0xff000000 | (XcursorPixel)c[0] << 16 |
+			         (XcursorPixel)c[1] << 8 | (XcursorPixel)c[2];
+		}
+		for (; x < w; ++x)
+			dst[x] = 0xff000000;
+	}
+}
+
+static void
+bilinear(XcursorImage *out, const Image *in)
+{
+	interpolate(out, in, 2);
+}
+
+static void
+bicubic(XcursorImage *out, const Image *in)
+{
+	interpolate(out, in, 4);
+}
+
+/*
+ * zoomed out (factor < 1): each output pixel is the average of the source
+ * pixels it covers, so that nothing aliases. the capture is only read through
+ * once, a row at a time: rows going into the same output row are summed up
+ * per column first, red and blue packed in one word, and only then per output
+ * column. the center pixel is left as is, since that's the one get_pixel()
+ * reports.
+ */
+static void
+area_average(XcursorImage *out, const Image *in)
+{
+	static Buf row_buf, col_buf, n_buf, inv_buf, acc_buf, v_buf;
+	const uint w = out->width, h = out->height;
+	/* offset of `in` within the unclipped area, which it may extend past
+	 * when clipped on the other side, see image_geometry() */
+	const uint hx = in->wanted.w / 2 - (uint)in->cx, hy = in->wanted.h / 2 - (uint)in->cy;
+	const uint iw = MIN(in->w, in->wanted.w - hx), ih = MIN(in->h, in->wanted.h - hy);
+	const PixelConv conv = ximg_conv(in->im);
+	XcursorPixel *row, *dst;
+	uint *col, *n, *vrb, *vg, x, i, j, rows = 0, batch = 0, oy = 0;
+	int *ar, *ag, *ab; /* per output column, planar so that it vectorizes */
+	float *inv;
+
+	ASSERT(in->wanted.w >= w && in->wanted.h >= h);
+	ASSERT(in->cx >= 0 && (uint)in->cx <= in->wanted.w / 2);
+	row = buf_get(&row_buf, (iw + 1) * sizeof *row);
+	col = buf_get(&col_buf, (iw + 1) * sizeof *col);
+	vrb = buf_get(&v_buf, (iw + 1) * 2 * sizeof *vrb);
+	vg = vrb + iw + 1;
+	n = buf_get(&n_buf, w * sizeof *n);
+	inv = buf_get(&inv_buf, w * sizeof *inv);
+	ar = buf_get(&acc_buf, w * 3 * sizeof *ar);
+	ag = ar + w;
+	ab = ag + w;
+	memset(n, 0, w * sizeof *n);
+	memset(ar, 0, w * 3 * sizeof *ar);
+	memset(vrb, 0, (iw + 1) * 2 * sizeof *vrb);
+	for (i = 0; i < iw; ++i) { /* the output column of each input one */
+		col[i] = (uint)((ulong)(i + hx) * w / in->wanted.w);
+		++n[col[i]];
+	}
+	for (x = 0; x < w; ++x) /* clipped out columns come out black */
+		inv[x] = n[x] > 0 ? 1.0f / (float)n[x] : 0.0f;
+	for (i = 0; i < w * h; ++i)
+		out->pixels[i] = 0xff000000;
+
+	for (j = 0; j <= ih; ++j) {
+		const uint o = j < ih ? (uint)((ulong)(j + hy) * h / in->wanted.h) : h;
+
+		/* 8bit channels fit 256 rows into the packed 16bit halves */
+		if (batch > 0 && (o != oy || batch == 256)) {
+			for (i = 0; i < iw; ++i) {
+				ar[col[i]] += (int)(vrb[i] >> 16);
+				ag[col[i]] += (int)(vg[i] >> 8);
+				ab[col[i]] += (int)(vrb[i] & 0xffff);
+			}
+			memset(vrb, 0, (iw + 1) * 2 * sizeof *vrb);
+			batch = 0;
+		}
+		if (o != oy && rows > 0) {
+			const float r = 1.0f / (float)rows;
+			dst = out->pixels + (size_t)oy * w;
+			for (x = 0; x < w; ++x) {
+				const float k = inv[x] * r;
+				dst[x] = (XcursorPixel)0xff000000 |
+				         (XcursorPixel)(int)((float)ar[x] * k + 0.5f) << 16 |
+				         (XcursorPixel)(int)((float)ag[x] * k + 0.5f) << 8 |
+				         (XcursorPixel)(int)((float)ab[x] * k + 0.5f);
+			}
+			memset(ar, 0, w * 3 * sizeof *ar);
+			rows = 0;
+		}
+		if (j == ih)
+			break;
+		oy = o;
+		++rows;
+		++batch;
+		conv(row, ximg_at(in->im, 0, j), iw);
+		for (i = 0; i < iw; ++i) {
+			vrb[i] += row[i] & 0xff00ff;
+			vg[i] += row[i] & 0xff00;
+		}
+	}
+
+	conv(row, ximg_at(in->im, (uint)in->cx, (uint)in->cy), 1);
+	out->pixels[(h / 2) * w + w / 2] = row[0];
+}
+
+static void
+square(XcursorImage *img)
+{
+	size_t i, k;
+	const uint b = SQUARE_WIDTH;
+
+	i = 0;
+	while (i < img->width * b + b) /* draw the top border + 1 left side */
+		img->pixels[i++] = SQUARE_COLOR;
+	do {
+		i += img->width - b * 2; /* skip the mid */
+		for (k = 0; k < b*2; ++k)
+			img->pixels[i++] = SQUARE_COLOR;
+	} while (i < (img->height - b) * img->width);
+	while (i < img->width * img->height) /* draw the rest */
+		img->pixels[i++] = SQUARE_COLOR;
+}
+
+static void
+xhair(XcursorImage *img)
+{
+	uint x, y;
+	const uint c = img->height / 2;
+	const uint b = XHAIR_SIZE;
+	const uint bw = XHAIR_BORDER_WIDTH ;
+
+	for (y = c - b; y <= c + b; ++y) {
+		for (x = c - b; x <= c + b; ++x) {
+			if (DIFF(x, c) > b - bw || DIFF(y, c) > b - bw)
+				img->pixels[y * img->width + x] = XHAIR_COLOR;
+		}
+	}
+}
+
+static void
+grid(XcursorImage *img)
+{
+	uint x, y;
+	const uint z = GRID_SIZE;
+	const uint c = (img->height / 2) + (z / 2);
+
+	for (y = 0; y < img->height; ++y) {
+		if (DIFF(c, y) % z == 0) {
+			for (x = 0; x < img->width; ++x)
+				img->pixels[y * img->width + x] = GRID_COLOR;
+		} else for (x = c % z; x < img->width; x += z) {
+			img->pixels[y * img->width + x] = GRID_COLOR;
+		}
+	}
+}
+
+static void
+four_point_draw(XcursorImage *img, uint x, uint y, XcursorPixel col) /* naming is hard */
+{
+	uint w = img->width, h = img->height;
+	ASSERT(x <= w/2); ASSERT(y <= h/2);
+	img->pixels[y * w + x] = col;
+	img->pixels[y * w + (w - x - 1)] = col;
+	img->pixels[(h - y - 1) * w + x] = col;
+	img->pixels[(h - y - 1) * w + (w - x - 1)] = col;
+}
+
+/* TODO: reduce jaggedness */
 static void
 circle(XcursorImage *img)
 {
@@ -558,177 +4261,723 @@ circle(XcursorImage *img)
 	uint br = r - CIRCLE_WIDTH;
 	uint c = h / 2;
 
-	for (y = 0; y < h / 2 + (h & 1); ++y) {
-		for (x = 0; x < w / 2 + (w & 1); ++x) {
-			uint tx = c - x;
-			uint ty = c - y;
-			uint x2y2 = (tx * tx) + (ty * ty);
+	for (y = 0; y < h / 2 + (h & 1); ++y) {
+		for (x = 0; x < w / 2 + (w & 1); ++x) {
+			uint tx = c - x;
+			uint ty = c - y;
+			uint x2y2 = (tx * tx) + (ty * ty);
+
+			if (x2y2 > (r * r)) { /* outside the circle border */
+				if (CIRCLE_TRANSPARENT_OUTSIDE)
+					four_point_draw(img, x, y, 0x0);
+			} else if (x2y2 > (br * br)) { /* inside the circle border */
+				four_point_draw(img, x, y, CIRCLE_COLOR);
+			} else { /* inside the circle, nothing to do. move on to the next y */
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * the filters usually only depend on the image size, so run them once over
+ * two different backgrounds: pixels that come out the same are covered by the
+ * overlay, pixels that come out as their background are left alone. anything
+ * else means the sequence depends on the frame content, in which case it gets
+ * run on every frame instead.
+ */
+static void
+overlay_build(const XcursorImage *img)
+{
+	const XcursorPixel bg[2] = { 0x01234567, 0xfedcba98 };
+	XcursorImage *probe[2];
+	size_t i, n = (size_t)img->width * img->height;
+	int in_span = 0;
+	uint k, f;
+
+	free(overlay.px);
+	free(overlay.span);
+	overlay.px = malloc(n * sizeof *overlay.px);
+	overlay.span = malloc((n + 1) * sizeof *overlay.span);
+	if (overlay.px == NULL || overlay.span == NULL)
+		fatal("out of memory");
+	for (k = 0; k < 2; ++k) {
+		if ((probe[k] = XcursorImageCreate((int)img->width, (int)img->height)) == NULL)
+			fatal("failed to create cursor image");
+		for (i = 0; i < n; ++i)
+			probe[k]->pixels[i] = bg[k];
+		for (f = 0; f < filter->len; ++f)
+			filter->f[f](probe[k]);
+	}
+
+	overlay.dynamic = 0;
+	overlay.nspan = 0;
+	for (i = 0; i < n && !overlay.dynamic; ++i) {
+		XcursorPixel a = probe[0]->pixels[i], b = probe[1]->pixels[i];
+		int covered = a == b;
+
+		overlay.dynamic = !covered && !(a == bg[0] && b == bg[1]);
+		overlay.px[i] = a;
+		if (covered != in_span)
+			overlay.span[overlay.nspan++] = (uint)i;
+		in_span = covered;
+	}
+	if (in_span)
+		overlay.span[overlay.nspan++] = (uint)n;
+	for (k = 0; k < 2; ++k)
+		XcursorImageDestroy(probe[k]);
+	overlay.w = img->width;
+	overlay.h = img->height;
+	overlay.valid = 1;
+}
+
+static void
+filter_apply(XcursorImage *img)
+{
+	uint i;
+
+	if (!overlay.valid || overlay.w != img->width || overlay.h != img->height)
+		overlay_build(img);
+	if (overlay.dynamic) {
+		for (i = 0; i < filter->len; ++i)
+			filter->f[i](img);
+		return;
+	}
+	for (i = 0; i < overlay.nspan; i += 2) {
+		uint a = overlay.span[i], b = overlay.span[i + 1];
+		if (b - a < 16) { /* e.g grid lines, not worth calling memcpy */
+			for (; a < b; ++a)
+				img->pixels[a] = overlay.px[a];
+		} else {
+			memcpy(img->pixels + a, overlay.px + a, (b - a) * sizeof *img->pixels);
+		}
+	}
+}
+
+static void
+magnify(const int x, const int y, Bool window)
+{
+	ulong t0 = stats_now(), t = t0;
+	/* capture_prefetch() may pick up new ones in --threaded mode */
+	const float factor = MAG_FACTOR;
+	const uint box = sample.n;
+	const Image *cap = capture_get(x, y, window), *img;
+	Image loupe;
+	XImage view;
+	Cursor new_cur;
+	Bool same;
+
+	x11.damage.area.x = (short)cap->x;
+	x11.damage.area.y = (short)cap->y;
+	x11.damage.area.width = (ushort)cap->w;
+	x11.damage.area.height = (ushort)cap->h;
+	if (cap->im->bytes_per_line < cap->im->width * (cap->im->bits_per_pixel / 8))
+		fatal("unexpected XImage format");
+	img = image_crop(&loupe, &view, cap, (uint)((float)MAG_SIZE / factor));
+	capture_prefetch(window);
+	same = pace_frame(frame_hash(cap, img, factor, box, x, y, window));
+	t = stats_record(STAGE_CAPTURE, t);
+	if (same) { /* nothing to scale, filter or upload */
+		++stats.deduped;
+		stats_record(STAGE_FRAME, t0);
+		return;
+	}
+	(factor < 1.0f ? area_average : mag_func)(cursor_img, img);
+	t = stats_record(STAGE_SCALE, t);
+	sample_update(cap, box);
+	t = stats_record(STAGE_SAMPLE, t);
+
+	filter_apply(cursor_img);
+	if (sample.valid)
+		sample_draw(cursor_img, box, factor);
+	t = stats_record(STAGE_FILTER, t);
+	if (window) {
+		mwin_present(cursor_img, x, y);
+		new_cur = None;
+	} else {
+		new_cur = upload_cursor(cursor_img);
+	}
+	t = stats_record(STAGE_UPLOAD, t);
+	if (x11.thr.on) {
+		thr_publish(new_cur);
+	} else if (!window) {
+		if (x11.valid.cur)
+			XFreeCursor(x11.dpy, x11.cur);
+		x11.cur = new_cur;
+		x11.valid.cur = 1;
+		XChangeActivePointerGrab(x11.input, x11.grab_mask, x11.cur, CurrentTime);
+	}
+	if (stats.on) /* otherwise it'd get flushed whenever we next block */
+		XFlush(x11.dpy);
+	stats_record(STAGE_GRAB, t);
+	stats_record(STAGE_FRAME, t0);
+}
+
+/* events on the rendering connection, returns true if a redraw is needed */
+static Bool
+render_event(const XEvent *ev, Bool window)
+{
+	if (x11.valid.damage && ev->type == x11.damage.ev_base + XDamageNotify)
+		return damage_handle(ev);
+	else if (x11.valid.upload && ev->type == x11.upload.shm_ev)
+		upload_complete(ev);
+	else if (window)
+		mwin_event(ev);
+	return False;
+}
+
+/* --threaded: redraws on new input, damage or periodically, as paced */
+static void *
+render_main(void *arg)
+{
+	const Bool window = ((const Options *)arg)->mag_window;
+	Bool dirty = False, have = False, fresh = False;
+
+	while (!x11.thr.quit) {
+		struct pollfd pfd[2];
+		int timeout = -1;
+		Bool idle;
+
+		if (fresh || (have && dirty))
+			timeout = pace_timeout(False);
+		else if (have && redraw_periodic())
+			timeout = pace_timeout(True);
+		pfd[0].fd = ConnectionNumber(x11.dpy);
+		pfd[1].fd = x11.thr.wake[0];
+		pfd[0].events = pfd[1].events = POLLIN;
+		idle = XPending(x11.dpy) == 0 && poll(pfd, 2, timeout) == 0;
+		thr_drain(x11.thr.wake[0]);
+
+		while (XPending(x11.dpy) > 0) {
+			XEvent ev;
+			XNextEvent(x11.dpy, &ev);
+			dirty |= render_event(&ev, window);
+		}
+		fresh |= thr_input();
+		fresh |= x11.thr.fresh;
+		x11.thr.fresh = False;
+		if (pace_timeout(!fresh && !dirty) > 0) /* keeps coalescing meanwhile */
+			continue;
+		if (fresh || (have && (dirty || idle))) {
+			/* copy, capture_prefetch() may move the front along */
+			InputState in = x11.thr.input[x11.thr.in.front];
+			magnify(in.x, in.y, window);
+			if (fresh && in.time != CurrentTime)
+				stats_motion(in.time, True);
+			else
+				++stats.idle;
+		}
+		dirty = False;
+		have |= fresh;
+		fresh = False;
+	}
+	return NULL;
+}
+
+/* the pipe wakes up the event loop, however close to poll() it arrives */
+static void
+sighandler(int sig)
+{
+	const int err = errno;
+
+	sig_recieved = sig_recieved ? sig_recieved : sig;
+	if (sig_pipe[1] >= 0)
+		thr_wake(sig_pipe[1]);
+	errno = err;
+}
+
+/*
+ * --record/--replay: the input events pick() acts on, so that a session can
+ * be played back through the same code paths at full speed, e.g under Xvfb.
+ *
+ * The file starts with REC_MAGIC, the screen size, pointer position, zoom
+ * and --sample box, followed by the --freeze snapshot if there was one:
+ * runs of identical pixels, as a count and 3 bytes of RGB. Then come the
+ * events, a type byte each, with the time and position as deltas from the
+ * previous one. All numbers are LEB128 varints, signed ones zigzag encoded.
+ */
+#define REC_MAGIC "sxcsrec1"
+enum { REC_MOTION = 1, REC_PRESS, REC_RELEASE, REC_KEY };
+enum { REC_SNAPSHOT = 1 << 0 };
+
+static void
+rec_put(ulong v)
+{
+	for (; v >= 0x80; v >>= 7)
+		putc((int)(v & 0x7F) | 0x80, rec.fp);
+	putc((int)v, rec.fp);
+}
+
+static void
+rec_put_int(long v)
+{
+	rec_put(v < 0 ? (ulong)(-(v + 1)) << 1 | 1 : (ulong)v << 1);
+}
+
+static ulong
+float_bits(float f)
+{
+	uint u;
+	ASSERT(sizeof u == sizeof f);
+	memcpy(&u, &f, sizeof u);
+	return u;
+}
+
+static void
+record_open(const char *path)
+{
+	Window root, child;
+	int wx, wy;
+	uint mask;
+
+	if ((rec.fp = fopen(path, "wb")) == NULL)
+		fatal("--record: failed to open `%s`: %s", path, strerror(errno));
+	XQueryPointer(x11.dpy, x11.root.win, &root, &child, &rec.x, &rec.y, &wx, &wy, &mask);
+	fputs(REC_MAGIC, rec.fp);
+	rec_put(x11.root.w);
+	rec_put(x11.root.h);
+	rec_put((ulong)rec.x);
+	rec_put((ulong)rec.y);
+	rec_put(float_bits(MAG_FACTOR));
+	rec_put(sample.n);
+	rec_put(freeze.im != NULL ? REC_SNAPSHOT : 0);
+
+	if (freeze.im != NULL) {
+		const PixelConv conv = ximg_conv(freeze.im);
+		XcursorPixel *row = malloc(x11.root.w * sizeof *row), prev = 0;
+		ulong run = 0;
+		uint x, y;
+
+		if (row == NULL)
+			fatal("out of memory");
+		for (y = 0; y < x11.root.h; ++y) {
+			conv(row, ximg_at(freeze.im, 0, y), x11.root.w);
+			for (x = 0; x < x11.root.w; ++x) {
+				if (run > 0 && row[x] == prev) {
+					++run;
+					continue;
+				}
+				if (run > 0) {
+					rec_put(run);
+					putc((int)(prev >> 16 & 0xFF), rec.fp);
+					putc((int)(prev >> 8 & 0xFF), rec.fp);
+					putc((int)(prev & 0xFF), rec.fp);
+				}
+				prev = row[x];
+				run = 1;
+			}
+		}
+		rec_put(run);
+		putc((int)(prev >> 16 & 0xFF), rec.fp);
+		putc((int)(prev >> 8 & 0xFF), rec.fp);
+		putc((int)(prev & 0xFF), rec.fp);
+		free(row);
+	}
+}
+
+static void
+record_pos(uint type, Time time, int x, int y)
+{
+	putc((int)type, rec.fp);
+	rec_put((time - rec.time) & 0xFFFFFFFF);
+	rec_put_int((long)x - rec.x);
+	rec_put_int((long)y - rec.y);
+	rec.time = time;
+	rec.x = x;
+	rec.y = y;
+}
+
+static void
+record_event(XEvent *ev)
+{
+	switch (ev->type) {
+	case MotionNotify:
+		record_pos(REC_MOTION, ev->xmotion.time, ev->xmotion.x_root, ev->xmotion.y_root);
+		break;
+	case ButtonPress: case ButtonRelease:
+		record_pos(
+			ev->type == ButtonPress ? REC_PRESS : REC_RELEASE,
+			ev->xbutton.time, ev->xbutton.x_root, ev->xbutton.y_root
+		);
+		rec_put(ev->xbutton.button);
+		rec_put(ev->xbutton.state);
+		break;
+	case KeyPress: /* keycodes are up to the server, the keysym isn't */
+		record_pos(REC_KEY, ev->xkey.time, ev->xkey.x_root, ev->xkey.y_root);
+		rec_put((ulong)XLookupKeysym(&ev->xkey, 0));
+		rec_put(ev->xkey.state);
+		break;
+	}
+}
+
+static void
+record_close(void)
+{
+	if (fclose(rec.fp) != 0)
+		fatal("--record: failed to write: %s", strerror(errno));
+	rec.fp = NULL;
+}
+
+static ulong
+replay_get(void)
+{
+	ulong v = 0;
+	uint shift;
+
+	for (shift = 0; rec.pos < rec.len && shift < 35; shift += 7) {
+		const uchar b = rec.buf[rec.pos++];
+		v |= (ulong)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return v & 0xFFFFFFFF;
+	}
+	fatal("--replay: truncated or corrupt file");
+	return 0;
+}
+
+static long
+replay_get_int(void)
+{
+	const ulong v = replay_get();
+	return v & 1 ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+/* a zoom factor, which has to be sane at least */
+static float
+replay_get_zoom(void)
+{
+	uint u = (uint)replay_get();
+	float f;
+
+	memcpy(&f, &u, sizeof f);
+	if (!(f > 0.0f && f < 1e6f))
+		fatal("--replay: truncated or corrupt file");
+	return MAX(MAG_FACTOR_MIN, f);
+}
+
+/*
+ * reads in the whole file. the recorded zoom and box become the starting
+ * ones, and a snapshot takes the place of --freeze's, screen size included.
+ */
+static void
+replay_open(const char *path, Options *opt)
+{
+	FILE *f;
+	size_t n;
+	ulong w, h, box;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		fatal("--replay: failed to open `%s`: %s", path, strerror(errno));
+	for (rec.len = 0, rec.buf = NULL;; rec.len += n) {
+		enum { CHUNK = 1 << 16 };
+		uchar *p = realloc(rec.buf, rec.len + CHUNK);
+		if (p == NULL)
+			fatal("out of memory");
+		rec.buf = p;
+		if ((n = fread(rec.buf + rec.len, 1, CHUNK, f)) == 0)
+			break;
+	}
+	if (ferror(f))
+		fatal("--replay: failed to read `%s`", path);
+	fclose(f);
+	rec.replay = True;
+
+	if (rec.len < sizeof REC_MAGIC - 1 || memcmp(rec.buf, REC_MAGIC, sizeof REC_MAGIC - 1) != 0)
+		fatal("--replay: `%s` is not an sxcs recording", path);
+	rec.pos = sizeof REC_MAGIC - 1;
+	w = replay_get();
+	h = replay_get();
+	rec.x = (int)replay_get();
+	rec.y = (int)replay_get();
+	MAG_FACTOR = replay_get_zoom();
+	box = replay_get();
+	if (w == 0 || h == 0 || w > 1 << 15 || h > 1 << 15 || box == 0)
+		fatal("--replay: truncated or corrupt file");
+	sample.n = (uint)MIN(box, SAMPLE_MAX);
 
-			if (x2y2 > (r * r)) { /* outside the circle border */
-				if (CIRCLE_TRANSPARENT_OUTSIDE)
-					four_point_draw(img, x, y, 0x0);
-			} else if (x2y2 > (br * br)) { /* inside the circle border */
-				four_point_draw(img, x, y, CIRCLE_COLOR);
-			} else { /* inside the circle, nothing to do. move on to the next y */
-				break;
+	if (replay_get() & REC_SNAPSHOT) {
+		XImage *im = calloc(1, sizeof *im);
+		uchar *p, *end;
+
+		if (im == NULL || (im->data = malloc(w * h * 4)) == NULL)
+			fatal("out of memory");
+		im->width = (int)w;
+		im->height = (int)h;
+		im->format = ZPixmap;
+		im->byte_order = LSBFirst;
+		im->bitmap_unit = im->bitmap_pad = 32;
+		im->depth = 24;
+		im->bits_per_pixel = 32;
+		im->bytes_per_line = (int)w * 4;
+		im->red_mask = 0xFF0000;
+		im->green_mask = 0xFF00;
+		im->blue_mask = 0xFF;
+		XInitImage(im);
+		for (p = (uchar *)im->data, end = p + w * h * 4; p < end;) {
+			const ulong run = replay_get();
+			uchar rgb[3];
+
+			if (run == 0 || run > (ulong)(end - p) / 4 || rec.len - rec.pos < 3)
+				fatal("--replay: truncated or corrupt file");
+			memcpy(rgb, rec.buf + rec.pos, 3);
+			rec.pos += 3;
+			for (n = 0; n < run; ++n, p += 4) {
+				p[0] = rgb[2];
+				p[1] = rgb[1];
+				p[2] = rgb[0];
+				p[3] = 0;
 			}
 		}
+		freeze.im = im;
+		x11.root.w = (uint)w;
+		x11.root.h = (uint)h;
+		opt->freeze = 1;
 	}
 }
 
-static void
-magnify(const int x, const int y)
+/*
+ * the next recorded event, False once they've run out. their time is now,
+ * so that the latency stats are from being read in until drawn.
+ */
+static Bool
+replay_next(XEvent *ev)
 {
-	const uint c = (uint)((float)MAG_SIZE / MAG_FACTOR);
-	const int off = c / 2;
-	uint i;
-	Image img;
-	Cursor new_cur;
+	uint type;
+	int x, y;
 
-	img.x = (uint)MAX(0, x - off);
-	img.y = (uint)MAX(0, y - off);
-	img.w = MIN(c, x11.root.w - img.x);
-	img.h = MIN(c, x11.root.h - img.y);
-	img.cx = x - (int)img.x;
-	img.cy = y - (int)img.y;
-	img.wanted.w = img.wanted.h = c;
-	/* TODO: look into Shm extension to reduce allocation overhead. */
-	img.im = XGetImage(
-		x11.dpy, x11.root.win, (int)img.x, (int)img.y, img.w, img.h,
-		AllPlanes, ZPixmap
-	);
-	if (img.im == NULL)
-		fatal("failed to get image");
-	if (img.im->bits_per_pixel != 32 ||
-	    img.im->bytes_per_line != (img.im->width * 4) ||
-	    !(img.im->depth == 24 || img.im->depth == 32))
-	{ /* ximg_pixel_get() depends on these */
-		fatal("unexpected XImage format");
+	if (rec.pos == rec.len)
+		return False;
+	type = rec.buf[rec.pos++];
+	if (type < REC_MOTION || type > REC_KEY)
+		fatal("--replay: truncated or corrupt file");
+	replay_get(); /* the recorded time, only there for completeness */
+	x = rec.x + (int)replay_get_int();
+	y = rec.y + (int)replay_get_int();
+	if (x != rec.x || y != rec.y) /* for the loupe, the motion it causes is dropped */
+		XWarpPointer(x11.input, None, x11.root.win, 0, 0, 0, 0, x, y);
+	rec.x = x;
+	rec.y = y;
+
+	memset(ev, 0, sizeof *ev);
+	ev->xany.display = x11.input;
+	ev->xkey.root = ev->xkey.window = x11.root.win;
+	ev->xkey.time = mono_ms() & 0xFFFFFFFF;
+	ev->xkey.x = ev->xkey.x_root = rec.x;
+	ev->xkey.y = ev->xkey.y_root = rec.y;
+	ev->xkey.same_screen = True;
+	/* the members so far are laid out the same in all three */
+	switch (type) {
+	case REC_MOTION:
+		ev->type = MotionNotify;
+		break;
+	case REC_PRESS: case REC_RELEASE:
+		ev->type = type == REC_PRESS ? ButtonPress : ButtonRelease;
+		ev->xbutton.button = (uint)replay_get();
+		ev->xbutton.state = (uint)replay_get();
+		break;
+	case REC_KEY:
+		ev->type = KeyPress;
+		ev->xkey.keycode = XKeysymToKeycode(x11.input, (KeySym)replay_get());
+		ev->xkey.state = (uint)replay_get();
+		break;
 	}
-	mag_func(cursor_img, &img);
-	XDestroyImage(img.im);
+	return True;
+}
 
-	for (i = 0; i < filter->len; ++i)
-		filter->f[i](cursor_img);
-	new_cur = XcursorImageLoadCursor(x11.dpy, cursor_img);
-	if (x11.valid.cur)
-		XFreeCursor(x11.dpy, x11.cur);
-	x11.cur = new_cur;
-	x11.valid.cur = 1;
-	XChangeActivePointerGrab(x11.dpy, x11.grab_mask, x11.cur, CurrentTime);
+/* X events other than input still need handling, the recorded ones replace the rest */
+static Bool
+replay_drain(Bool window)
+{
+	Bool dirty = False;
+	XEvent ev;
+
+	while (XPending(x11.input) > 0) {
+		XNextEvent(x11.input, &ev);
+		if (ev.type != MotionNotify && ev.type != ButtonPress &&
+		    ev.type != ButtonRelease && ev.type != KeyPress)
+		{
+			dirty |= render_event(&ev, window);
+		}
+	}
+	return dirty;
 }
 
+/* fatal(), unless it's a --daemon session, which only ends instead */
 static void
-sighandler(int sig)
+pick_fail(const char *msg)
 {
-	sig_recieved = sig_recieved ? sig_recieved : sig;
+	if (!srv.on)
+		fatal("%s", msg);
+	fprintf(stderr, PROGNAME ": %s\n", msg);
 }
 
-extern int
-main(int argc, char *argv[])
+/*
+ * A pick session: grab the pointer, and the keyboard if need be, and handle
+ * events until told to quit. Ran once, or once per --client with --daemon.
+ */
+static void
+pick(const Options *opt)
 {
-	Options opt;
 	struct { int x, y, valid; } old = {0};
 	XEvent ev;
-	Bool queued;
+	Bool queued, dirty = False, moved = False;
+	Time moved_at = CurrentTime; /* the first motion event `moved` is for */
 	int npending;
+	float *factor = &MAG_FACTOR, zoom = MAG_FACTOR;
+	uint *box = &sample.n, box_n = sample.n;
+	ulong *coalesced = &stats.coalesced, coalesced_n = stats.coalesced;
+	Bool render = False; /* the render thread is running */
 
-	opt = opt_parse(argc, argv);
-
-	if ((x11.dpy = XOpenDisplay(NULL)) == NULL)
-		fatal("failed to open x11 display");
-
-	{
-		XWindowAttributes tmp;
-		x11.root.win = DefaultRootWindow(x11.dpy);
-		if (XGetWindowAttributes(x11.dpy, x11.root.win, &tmp) == 0)
-			fatal("failed to get root window attributes");
-		x11.root.h = (uint)tmp.height;
-		x11.root.w = (uint)tmp.width;
-	}
-
-	{
-		XVisualInfo q = {0}, *r;
-		int d, dummy;
-
-		q.visualid = XVisualIDFromVisual(DefaultVisual(x11.dpy, DefaultScreen(x11.dpy)));
-		if ((r = XGetVisualInfo(x11.dpy, VisualIDMask, &q, &dummy)) == NULL)
-			fatal("failed to obtain visual info");
-		d = r->depth;
-		XFree(r);
-		if (d < 24)
-			fatal("X server does not support truecolor");
-	}
+	pace.valid = False; /* there's no loupe on screen yet */
+	if (opt->mag_window)
+		mwin_redirect(True);
 
-	if (opt.no_mag) {
-		x11.cur = XCreateFontCursor(x11.dpy, XC_tcross);
-		x11.valid.cur = 1;
-	} else {
-		cursor_img = XcursorImageCreate(MAG_SIZE, MAG_SIZE);
-		if (cursor_img == NULL)
-			fatal("failed to create cursor image");
-		cursor_img->xhot = cursor_img->yhot = MAG_SIZE / 2;
+	if (opt->threaded) { /* the render thread owns the globals */
+		factor = &zoom;
+		box = &box_n;
+		coalesced = &coalesced_n;
 	}
 
-	if (opt.quit_on_keypress || opt.keyboard) {
+	if (opt->quit_on_keypress || opt->keyboard) {
 		/* when launched via dwm keybinding, it fails the grab since
 		 * dwm has it grabbed already. listen for FocusChangeMask and
 		 * keep retrying. */
 		int res;
-		XSelectInput(x11.dpy, x11.root.win, FocusChangeMask);
+		XSelectInput(x11.input, x11.root.win, FocusChangeMask);
 		do {
 			res = XGrabKeyboard(
-				x11.dpy, x11.root.win, 0,
+				x11.input, x11.root.win, 0,
 				GrabModeAsync, GrabModeAsync, CurrentTime
 			);
-			XNextEvent(x11.dpy, &ev);
+			XNextEvent(x11.input, &ev);
 		} while (res == AlreadyGrabbed);
-		XSelectInput(x11.dpy, x11.root.win, 0x0);
+		XSelectInput(x11.input, x11.root.win, 0x0);
 		x11.valid.ungrab_kb = res == GrabSuccess;
-		if (!x11.valid.ungrab_kb)
-			fatal("failed to grab keyboard");
+		if (!x11.valid.ungrab_kb) {
+			pick_fail("failed to grab keyboard");
+			goto done;
+		}
 	}
 
 	{
 		int tmp;
 
 		x11.grab_mask = ButtonPressMask | PointerMotionMask;
+		if (opt->palette > 0)
+			x11.grab_mask |= ButtonReleaseMask;
 		tmp = XGrabPointer(
-			x11.dpy, x11.root.win, 0, x11.grab_mask, GrabModeAsync,
+			x11.input, x11.root.win, 0, x11.grab_mask, GrabModeAsync,
 			GrabModeAsync, x11.root.win, x11.cur, CurrentTime
 		);
 		x11.valid.ungrab_ptr = tmp == GrabSuccess;
-		if (!x11.valid.ungrab_ptr)
-			fatal("failed to grab cursor");
+		if (!x11.valid.ungrab_ptr) {
+			pick_fail("failed to grab cursor");
+			goto done;
+		}
 	}
 
-	{
-		int i, sigs[] = { SIGINT, SIGTERM, SIGKILL /* one can try */ };
-		for (i = 0; i < (int)ARRLEN(sigs); ++i)
-			signal(sigs[i], sighandler);
+	if (rec.replay) /* to where the recording started */
+		XWarpPointer(x11.input, None, x11.root.win, 0, 0, 0, 0, rec.x, rec.y);
+	if (!opt->no_mag) { /* the loupe shows up right away, not on the first motion */
+		Window root, child;
+		int wx, wy;
+		uint mask;
+		old.valid = XQueryPointer(
+			x11.input, x11.root.win, &root, &child, &old.x, &old.y, &wx, &wy, &mask
+		);
+		if (rec.replay) {
+			old.x = rec.x;
+			old.y = rec.y;
+		}
+		dirty = old.valid;
+	}
+
+	if (opt->threaded) {
+		sigset_t all, prev;
+		int err;
+
+		x11.thr.quit = False;
+		/* keep the signals coming to this thread, it's the one in poll() */
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &prev);
+		err = pthread_create(&x11.thr.tid, NULL, render_main, (void *)opt);
+		pthread_sigmask(SIG_SETMASK, &prev, NULL);
+		if (err != 0)
+			fatal("failed to create render thread: %s", strerror(err));
+		render = True;
 	}
 
 	for (queued = False, npending = 0; 1;) {
+		const Bool draw = !opt->threaded && !opt->no_mag && old.valid;
 		Bool pending;
-		struct pollfd pfd;
+		struct pollfd pfd[4];
+		int timeout = -1;
 
-		pfd.fd = ConnectionNumber(x11.dpy);
-		pfd.events = POLLIN;
-		pending = queued || npending > 0 || (npending = XPending(x11.dpy)) > 0 ||
-		          poll(&pfd, 1, MAX_FRAME_TIME) > 0;
+		if (opt->threaded)
+			thr_show();
+		if (opt->threaded && dirty)
+			timeout = 0;
+		else if (draw && (dirty || moved))
+			timeout = pace_timeout(False);
+		else if (draw && redraw_periodic())
+			timeout = pace_timeout(True);
+		pfd[0].fd = ConnectionNumber(x11.input);
+		pfd[1].fd = sig_pipe[0];
+		pfd[2].fd = opt->threaded ? x11.thr.done[0] : -1;
+		pfd[3].fd = srv.client; /* only hangups are of interest */
+		pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+		pfd[3].events = 0;
+		pfd[2].revents = pfd[3].revents = 0;
+		if (rec.replay) { /* the next event once the last one is drawn, no waiting */
+			dirty |= replay_drain(opt->mag_window);
+			pending = queued || !(draw && (dirty || moved));
+			if (pending && !queued && !(queued = replay_next(&ev)))
+				goto done;
+		} else {
+			pending = queued || npending > 0 || (npending = XPending(x11.input)) > 0 ||
+			          poll(pfd, ARRLEN(pfd), timeout) > 0;
+		}
 
-		if (sig_recieved)
+		if (sig_recieved) {
+			if (render) { /* before --stats gets printed */
+				thr_stop();
+				stats.coalesced = coalesced_n;
+			}
 			exit(128 + sig_recieved);
+		}
+		if (pfd[3].revents || srv.gone)
+			goto done;
+
+		if (pfd[2].revents) { /* new frame, shown on the next iteration */
+			thr_drain(x11.thr.done[0]);
+			continue;
+		}
 
 		if (!pending) {
-			if (!opt.no_mag && old.valid)
-				magnify(old.x, old.y);
+			if (opt->threaded) {
+				if (old.valid && dirty)
+					thr_post(old.x, old.y, *factor, *box, CurrentTime, *coalesced);
+				dirty = False;
+			} else if (!draw) {
+				dirty = moved = False;
+			} else if ((dirty || moved || redraw_periodic()) &&
+			           pace_timeout(!dirty && !moved) == 0)
+			{
+				magnify(old.x, old.y, opt->mag_window);
+				npending = 0; /* capture_prefetch() may have touched the queue */
+				if (moved)
+					stats_motion(moved_at, True);
+				else
+					++stats.idle;
+				dirty = moved = False;
+			}
 			continue;
 		}
 
 		if (!queued) {
-			XNextEvent(x11.dpy, &ev);
+			XNextEvent(x11.input, &ev);
 			--npending;
+			if (rec.fp != NULL)
+				record_event(&ev);
 		}
 		queued = False;
 
@@ -736,51 +4985,94 @@ main(int argc, char *argv[])
 		case ButtonPress:
 			switch (ev.xbutton.button) {
 			case Button1:
-				print_color(ev.xbutton.x_root, ev.xbutton.y_root, opt.fmt);
-				if (opt.oneshot)
-					goto out;
+				if (opt->palette > 0) { /* picked on release */
+					sel_start(ev.xbutton.x_root, ev.xbutton.y_root);
+					break;
+				}
+				print_color(ev.xbutton.x_root, ev.xbutton.y_root, opt->fmt);
+				if (opt->oneshot)
+					goto done;
 				break;
 			case Button4:
-				MAG_FACTOR *= MAG_STEP;
+				if (ev.xbutton.state & ControlMask)
+					*box = sample_resize(*box, +1);
+				else
+					*factor *= MAG_STEP;
+				dirty = True;
 				break;
 			case Button5:
-				MAG_FACTOR = MAX(1.1f, MAG_FACTOR / MAG_STEP);
+				if (ev.xbutton.state & ControlMask)
+					*box = sample_resize(*box, -1);
+				else
+					*factor = MAX(MAG_FACTOR_MIN, *factor / MAG_STEP);
+				dirty = True;
 				break;
 			default:
-				goto out;
+				goto done;
 				break;
 			}
 			break;
-		case MotionNotify:
-			if (opt.no_mag)
+		case ButtonRelease:
+			if (ev.xbutton.button == Button1 && sel.on) {
+				sel_finish(ev.xbutton.x_root, ev.xbutton.y_root, opt);
+				if (opt->oneshot)
+					goto done;
+			}
+			break;
+		case MotionNotify: {
+			Time first = ev.xmotion.time;
+
+			if (opt->no_mag) {
+				if (sel.on)
+					sel_update(ev.xmotion.x_root, ev.xmotion.y_root);
 				break;
+			}
 
 			old.x = ev.xmotion.x_root;
 			old.y = ev.xmotion.y_root;
 			old.valid = 1;
-			while (npending > 0 || (npending = XPending(x11.dpy)) > 0) {
-				XNextEvent(x11.dpy, &ev);
+			if (!opt->threaded) /* the render thread does the accounting */
+				stats_motion(ev.xmotion.time, False);
+			while (!rec.replay && (npending > 0 || (npending = XPending(x11.input)) > 0)) {
+				XNextEvent(x11.input, &ev);
 				--npending;
+				if (rec.fp != NULL)
+					record_event(&ev);
 				if (ev.type == MotionNotify) { /* don't act on stale events */
 					old.x = ev.xmotion.x_root;
 					old.y = ev.xmotion.y_root;
+					if (!opt->threaded)
+						stats_motion(ev.xmotion.time, False);
+					++*coalesced;
 				} else {
 					queued = True;
 					break;
 				}
 			}
-			magnify(old.x, old.y);
-			break;
+			if (sel.on)
+				sel_update(old.x, old.y);
+			if (opt->threaded) {
+				thr_post(old.x, old.y, *factor, *box, first, *coalesced);
+			} else if (!moved && pace_timeout(False) == 0) {
+				magnify(old.x, old.y, opt->mag_window);
+				npending = 0;
+				stats_motion(first, True);
+			} else if (!moved) { /* drawn once it's due, from wherever it got to */
+				moved = True;
+				moved_at = first;
+			}
+			dirty = False;
+		} break;
 		case KeyPress: {
 			KeySym k = None;
 			int x = ev.xkey.x_root, y = ev.xkey.y_root;
 			int delta = (ev.xkey.state & ControlMask) ? 1 :
 			            ((ev.xkey.state & ShiftMask) ? 128 : 16);
 
-			if (opt.quit_on_keypress)
-				goto out;
+			if (opt->quit_on_keypress)
+				goto done;
 
-			if (opt.keyboard) {
+			if (opt->keyboard) {
 				char junk;
 				XLookupString(&ev.xkey, &junk, 1, &k, NULL);
 			}
@@ -790,38 +5082,499 @@ main(int argc, char *argv[])
 			case XK_l: case XK_L: case XK_Right: x += delta; break;
 			case XK_k: case XK_K: case XK_Up:    y -= delta; break;
 			case XK_j: case XK_J: case XK_Down:  y += delta; break;
-			case XK_q: case XK_Q: case XK_Escape: goto out; break;
+			case XK_q: case XK_Q: case XK_Escape: goto done; break;
 			case XK_minus: case XK_KP_Subtract:
-				MAG_FACTOR = MAX(1.1f, MAG_FACTOR / MAG_STEP);
+				if (ev.xkey.state & ControlMask)
+					*box = sample_resize(*box, -1);
+				else
+					*factor = MAX(MAG_FACTOR_MIN, *factor / MAG_STEP);
+				dirty = True;
 				break;
 			case XK_plus: case XK_KP_Add:
-				MAG_FACTOR *= MAG_STEP;
+				if (ev.xkey.state & ControlMask)
+					*box = sample_resize(*box, +1);
+				else
+					*factor *= MAG_STEP;
+				dirty = True;
 				break;
 			case XK_space:
-				print_color(ev.xkey.x_root, ev.xkey.y_root, opt.fmt);
-				if (opt.oneshot)
-					goto out;
+				print_color(ev.xkey.x_root, ev.xkey.y_root, opt->fmt);
+				if (opt->oneshot)
+					goto done;
+				break;
+			case XK_v: case XK_V:
+				if (opt->palette == 0) {
+					break;
+				} else if (!sel.on) {
+					sel_start(ev.xkey.x_root, ev.xkey.y_root);
+				} else {
+					sel_finish(ev.xkey.x_root, ev.xkey.y_root, opt);
+					if (opt->oneshot)
+						goto done;
+				}
 				break;
 			}
-			if (x != ev.xkey.x_root || y != ev.xkey.y_root)
-				XWarpPointer(x11.dpy, None, x11.root.win, 0, 0, 0, 0, x, y);
+			if ((x != ev.xkey.x_root || y != ev.xkey.y_root) && !rec.replay)
+				XWarpPointer(x11.input, None, x11.root.win, 0, 0, 0, 0, x, y);
 		} break;
 		default:
+			dirty |= render_event(&ev, opt->mag_window);
 			break;
 		}
 	}
 
-out:
-#ifdef DEBUG
+done:
+	if (sel.drawn) /* it's drawn straight on the screen */
+		sel_toggle();
+	sel.on = False;
+	if (render) { /* the last few may not have been picked up */
+		thr_stop();
+		stats.coalesced = coalesced_n;
+	}
 	if (x11.valid.ungrab_kb)
-		XUngrabKeyboard(x11.dpy, CurrentTime);
+		XUngrabKeyboard(x11.input, CurrentTime);
 	if (x11.valid.ungrab_ptr)
-		XUngrabPointer(x11.dpy, CurrentTime);
-	if (cursor_img != NULL)
+		XUngrabPointer(x11.input, CurrentTime);
+	x11.valid.ungrab_kb = x11.valid.ungrab_ptr = 0;
+	if (rec.fp != NULL)
+		record_close();
+	if (srv.on && !opt->no_mag && !opt->mag_window && !render && x11.valid.cur) {
+		/* the next session would otherwise start off with this loupe */
+		XFreeCursor(x11.dpy, x11.cur);
+		x11.cur = None;
+		x11.valid.cur = 0;
+	}
+	if (x11.valid.mwin_mapped) {
+		XUnmapWindow(x11.dpy, x11.mwin.win);
+		x11.valid.mwin_mapped = 0;
+	}
+	if (opt->mag_window) { /* after thr_stop(), it's the render thread's x11.dpy */
+		mwin_redirect(False);
+		XFlush(x11.dpy);
+	}
+	XFlush(x11.input);
+}
+
+/*
+ * opt_parse() for a request, False if it would've exited. the client, being
+ * the same binary, already checked it, so that's only for a misbehaving one.
+ */
+static Bool
+srv_parse(int argc, char *argv[], Options *ret)
+{
+	jmp_buf jmp;
+
+	srv.parse = &jmp;
+	if (setjmp(jmp) != 0) {
+		srv.parse = NULL;
+		return False;
+	}
+	*ret = opt_parse(argc, argv);
+	srv.parse = NULL;
+	return True;
+}
+
+/*
+ * --daemon/--client: the socket lives at $XDG_RUNTIME_DIR/sxcs-$DISPLAY, or
+ * under /tmp along with the uid. returns False without a $DISPLAY.
+ */
+static Bool
+srv_addr(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR"), *dpy = getenv("DISPLAY");
+	char *p = srv.addr.sun_path;
+
+	if (dpy == NULL || dpy[0] == '\0')
+		return False;
+	if (dir == NULL || dir[0] != '/')
+		dir = NULL;
+	if ((dir != NULL ? strlen(dir) : 4) + strlen(dpy) + 32 > sizeof srv.addr.sun_path)
+		fatal("--daemon: socket path too long");
+	srv.addr.sun_family = AF_UNIX;
+	if (dir != NULL) {
+		p = fmt_str(fmt_str(p, dir), "/" PROGNAME "-");
+	} else {
+		p = fmt_str(p, "/tmp/" PROGNAME "-");
+		p = fmt_uint(p, (ulong)getuid());
+		*p++ = '-';
+	}
+	for (; *dpy != '\0'; ++dpy) /* e.g `unix/:0` */
+		*p++ = *dpy == '/' ? '_' : *dpy;
+	*p = '\0';
+	return True;
+}
+
+static Bool
+srv_write(int fd, const char *p, size_t n)
+{
+	while (n > 0) {
+		ssize_t ret = write(fd, p, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return False;
+		p += ret;
+		n -= (size_t)ret;
+	}
+	return True;
+}
+
+static void
+srv_cleanup(void)
+{
+	unlink(srv.addr.sun_path);
+}
+
+static void
+srv_listen(void)
+{
+	int fd;
+	mode_t mask;
+
+	if (!srv_addr())
+		fatal("--daemon: DISPLAY is not set");
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		fatal("socket: %s", strerror(errno));
+	if (connect(fd, (struct sockaddr *)(void *)&srv.addr, sizeof srv.addr) == 0)
+		fatal("--daemon: already running at `%s`", srv.addr.sun_path);
+	close(fd); /* a failed connect() leaves it in an unspecified state */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		fatal("socket: %s", strerror(errno));
+	unlink(srv.addr.sun_path); /* left over from a crash */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)(void *)&srv.addr, sizeof srv.addr) < 0)
+		fatal("--daemon: bind `%s`: %s", srv.addr.sun_path, strerror(errno));
+	umask(mask);
+	atexit(srv_cleanup);
+	if (listen(fd, 8) < 0)
+		fatal("listen: %s", strerror(errno));
+	srv.fd = fd;
+	srv.on = True;
+}
+
+/* the client's options, NUL separated, until it shuts its end down */
+static int
+srv_request(char *buf, size_t cap, char **argv, int argv_cap)
+{
+	size_t len = 0, i;
+	int argc = 0;
+
+	for (;;) {
+		struct pollfd pfd;
+		ssize_t n;
+
+		pfd.fd = srv.client;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0) /* a stuck client shouldn't block others */
+			return -1;
+		if ((n = read(srv.client, buf + len, cap - len)) == 0)
+			break;
+		if (n < 0 && errno != EINTR)
+			return -1;
+		len += (size_t)MAX(n, 0);
+		if (len == cap)
+			return -1;
+	}
+	argv[argc++] = PROGNAME;
+	for (i = 0; i < len; i += strlen(buf + i) + 1) {
+		if (argc == argv_cap - 1)
+			return -1;
+		argv[argc++] = buf + i;
+	}
+	buf[len] = '\0'; /* unterminated junk at the end */
+	argv[argc] = NULL;
+	return argc;
+}
+
+/*
+ * --daemon: the display connection, capture buffers, cursor and so on are
+ * all set up once, after which it sleeps on the socket. Each `sxcs --client`
+ * then gets a pick session, as though it was sxcs itself, with the output
+ * sent back over the socket; all that's left to do on activation is parsing
+ * its options, grabbing and drawing the first frame.
+ */
+ATTR_NORETURN
+static void
+srv_run(const Options *opt)
+{
+	/* the rest get reset on every session */
+	const float mag = MAG_FACTOR;
+	const FilterSeq *const flt = filter;
+	const MagFunc func = mag_func;
+	const uint box = sample.n;
+	const Bool median = sample.median;
+	int out;
+
+	srv_listen();
+	signal(SIGPIPE, SIG_IGN);
+	if ((out = dup(STDOUT_FILENO)) < 0)
+		fatal("dup: %s", strerror(errno));
+	for (;;) {
+		enum { REQ_MAX = 4096, ARGS_MAX = 256 };
+		static char req[REQ_MAX + 1];
+		char *argv[ARGS_MAX];
+		struct pollfd pfd[4];
+		Options s;
+		int argc;
+
+		pfd[0].fd = srv.fd;
+		pfd[1].fd = sig_pipe[0];
+		pfd[2].fd = ConnectionNumber(x11.dpy);
+		pfd[3].fd = x11.input != x11.dpy ? ConnectionNumber(x11.input) : -1;
+		pfd[0].events = pfd[1].events = pfd[2].events = pfd[3].events = POLLIN;
+		pfd[0].revents = 0;
+		XFlush(x11.dpy);
+		XFlush(x11.input);
+		poll(pfd, ARRLEN(pfd), -1);
+		if (sig_recieved)
+			exit(128 + sig_recieved);
+		while (XPending(x11.dpy) > 0) { /* damage and such, keeps the cache honest */
+			XEvent ev;
+			XNextEvent(x11.dpy, &ev);
+			render_event(&ev, opt->mag_window);
+		}
+		while (x11.input != x11.dpy && XPending(x11.input) > 0) {
+			XEvent ev;
+			XNextEvent(x11.input, &ev);
+		}
+		if (!(pfd[0].revents & POLLIN) || (srv.client = accept(srv.fd, NULL, NULL)) < 0)
+			continue;
+
+		if ((argc = srv_request(req, REQ_MAX, argv, ARRLEN(argv))) > 0) {
+			MAG_FACTOR = mag;
+			filter = flt;
+			mag_func = func;
+			sample.n = box;
+			sample.median = median;
+			overlay.valid = 0;
+			if (!srv_parse(argc, argv, &s)) {
+				close(srv.client);
+				srv.client = -1;
+				continue;
+			}
+			s.no_mag = opt->no_mag;
+			s.mag_window = opt->mag_window;
+			s.threaded = opt->threaded;
+
+			fflush(stdout);
+			dup2(srv.client, STDOUT_FILENO);
+			srv.gone = False;
+			pick(&s);
+			fflush(stdout);
+			clearerr(stdout);
+			dup2(out, STDOUT_FILENO);
+		}
+		close(srv.client);
+		srv.client = -1;
+	}
+}
+
+/*
+ * --client: hand the options over to the daemon and relay what it prints.
+ * returns if there's no daemon to talk to, sxcs then simply carries on.
+ */
+static void
+srv_client(int argc, char *argv[])
+{
+	char buf[4096];
+	ssize_t n;
+	int fd, i;
+
+	if (!srv_addr() || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return;
+	if (connect(fd, (struct sockaddr *)(void *)&srv.addr, sizeof srv.addr) < 0) {
+		close(fd);
+		return;
+	}
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--client") == 0) /* the daemon isn't one */
+			continue;
+		if (!srv_write(fd, argv[i], strlen(argv[i]) + 1))
+			fatal("--client: failed to talk to the daemon: %s", strerror(errno));
+	}
+	shutdown(fd, SHUT_WR);
+	while ((n = read(fd, buf, sizeof buf)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || !srv_write(STDOUT_FILENO, buf, (size_t)n))
+			exit(1);
+	}
+	exit(0);
+}
+
+extern int
+main(int argc, char *argv[])
+{
+	Options opt;
+
+	opt = opt_parse(argc, argv);
+	opt_check(&opt);
+	if (opt.replay != NULL) /* the point of it */
+		stats.on = stats.print = True;
+	if (opt.client)
+		srv_client(argc, argv);
+	kernels_init();
+	color_init();
+	if (stats.on) {
+		stats.start = stats_now();
+		atexit(stats_dump);
+	}
+
+	if ((x11.dpy = XOpenDisplay(NULL)) == NULL)
+		fatal("failed to open x11 display");
+
+	{
+		XWindowAttributes tmp;
+		x11.root.win = DefaultRootWindow(x11.dpy);
+		if (XGetWindowAttributes(x11.dpy, x11.root.win, &tmp) == 0)
+			fatal("failed to get root window attributes");
+		x11.root.h = (uint)tmp.height;
+		x11.root.w = (uint)tmp.width;
+	}
+
+	{ /* the channel layouts ximg_conv() knows about */
+		XVisualInfo q = {0}, *r;
+		int dummy;
+		Bool ok;
+
+		q.visualid = XVisualIDFromVisual(DefaultVisual(x11.dpy, DefaultScreen(x11.dpy)));
+		if ((r = XGetVisualInfo(x11.dpy, VisualIDMask, &q, &dummy)) == NULL)
+			fatal("failed to obtain visual info");
+		ok = (r->red_mask == 0xFF0000 && r->green_mask == 0xFF00 && r->blue_mask == 0xFF) ||
+		     (r->red_mask == 0x3FF00000 && r->green_mask == 0xFFC00 && r->blue_mask == 0x3FF) ||
+		     (r->red_mask == 0xF800 && r->green_mask == 0x7E0 && r->blue_mask == 0x1F);
+		XFree(r);
+		if (!ok)
+			fatal("unsupported visual, needs 8 or 10 bit per channel, or 5-6-5 truecolor");
+	}
+
+	if (opt.replay != NULL) /* may bring its own snapshot, in place of --freeze's */
+		replay_open(opt.replay, &opt);
+	if (opt.freeze && freeze.im == NULL) /* before the magnifier gets anywhere near the screen */
+		freeze_init();
+	if (opt.record != NULL)
+		record_open(opt.record);
+	if (opt.batch) {
+		batch_run(opt.fmt);
+		goto out;
+	}
+	if (opt.watch > 0) {
+		x11.input = x11.dpy;
+		watch_run(opt.watch, opt.fmt);
+	}
+
+	if (opt.no_mag) {
+		x11.cur = XCreateFontCursor(x11.dpy, XC_tcross);
+		x11.valid.cur = 1;
+	} else {
+		/* largest capture area: the magnifier's or the --sample box,
+		 * and with the cache's halo around it. zooming out grows it. */
+		uint c = capture_max(MIN(MAG_FACTOR, 1.0f));
+		uint cw = MIN(c + 2 * CACHE_HALO_MAX, x11.root.w);
+		uint ch = MIN(c + 2 * CACHE_HALO_MAX, x11.root.h);
+
+		cursor_img = XcursorImageCreate(MAG_SIZE, MAG_SIZE);
+		if (cursor_img == NULL)
+			fatal("failed to create cursor image");
+		cursor_img->xhot = cursor_img->yhot = MAG_SIZE / 2;
+		if (!opt.freeze)
+			capture_init(cw, ch);
+		upload_init(cursor_img);
+		if (opt.mag_window) /* XDamage would keep reporting our own repaints */
+			mwin_init(MIN(c, x11.root.w), MIN(c, x11.root.h));
+		else if (!opt.freeze)
+			damage_init();
+		if (x11.valid.damage && CACHE_MAX_AGE > 0)
+			cache_init(cw, ch);
+		x11.cap.reserved = c;
+		pace_init();
+		if (rec.replay) /* as fast as it goes */
+			pace.period = 0;
+	}
+
+	if (opt.threaded) {
+		/* everything above stays with the render thread */
+		XSync(x11.dpy, False);
+		if ((x11.input = XOpenDisplay(NULL)) == NULL)
+			fatal("failed to open x11 display");
+		thr_init();
+	} else {
+		x11.input = x11.dpy;
+	}
+
+	{
+		int i, sigs[] = { SIGINT, SIGTERM, SIGKILL /* one can try */ };
+		thr_pipe(sig_pipe);
+		for (i = 0; i < (int)ARRLEN(sigs); ++i)
+			signal(sigs[i], sighandler);
+	}
+
+	if (opt.daemon)
+		srv_run(&opt);
+	pick(&opt);
+
+out:
+#ifdef DEBUG
+	if (x11.thr.on) {
+		uint i;
+		for (i = 0; i < ARRLEN(x11.thr.frame); ++i) {
+			if (x11.thr.frame[i].cur != None)
+				XFreeCursor(x11.dpy, x11.thr.frame[i].cur);
+			XcursorImageDestroy(x11.thr.frame[i].img);
+		}
+		close(x11.thr.wake[0]); close(x11.thr.wake[1]);
+		close(x11.thr.done[0]); close(x11.thr.done[1]);
+	} else if (cursor_img != NULL) {
 		XcursorImageDestroy(cursor_img);
+	}
+	if (x11.valid.damage)
+		XDamageDestroy(x11.dpy, x11.damage.d);
+	if (x11.mwin.win != None) {
+		XDestroyWindow(x11.dpy, x11.mwin.win);
+		XFreePixmap(x11.dpy, x11.mwin.dst);
+		free(x11.mwin.tl);
+		if (x11.mwin.stack != NULL)
+			XFree(x11.mwin.stack);
+	}
+	if (x11.valid.upload) {
+		uint i;
+		for (i = 0; i < ARRLEN(x11.upload.slot); ++i) {
+			if (x11.upload.slot[i].im != NULL)
+				shm_image_destroy(&x11.upload.slot[i].info, x11.upload.slot[i].im);
+			XRenderFreePicture(x11.dpy, x11.upload.slot[i].pic);
+			XFreePixmap(x11.dpy, x11.upload.slot[i].pix);
+		}
+		XFreeGC(x11.dpy, x11.upload.gc);
+		x11.upload.plain->data = NULL;
+		XDestroyImage(x11.upload.plain);
+	}
+	free(cache.px);
+	if (freeze.shm) { /* already detached from the server */
+		shmdt(freeze.info.shmaddr);
+		freeze.im->data = NULL;
+	}
+	if (freeze.im != NULL)
+		XDestroyImage(freeze.im);
+	free(sample.sat.p);
+	free(sample.row.p);
+	free(rec.buf);
+	if (x11.valid.cap) {
+		uint i;
+		for (i = 0; i < ARRLEN(x11.cap.slot); ++i) {
+			if (x11.cap.slot[i].busy)
+				xcb_discard_reply(x11.cap.c, x11.cap.slot[i].seq);
+			if (x11.cap.slot[i].shm != NULL)
+				shm_image_destroy(&x11.cap.slot[i].info, x11.cap.slot[i].shm);
+			free(x11.cap.slot[i].reply);
+		}
+	}
 	if (x11.valid.cur)
 		XFreeCursor(x11.dpy, x11.cur);
+	if (sel.gc != NULL)
+		XFreeGC(x11.input, sel.gc);
 #endif
+	if (x11.input != NULL && x11.input != x11.dpy)
+		XCloseDisplay(x11.input);
 	if (x11.dpy != NULL)
 		XCloseDisplay(x11.dpy);
 